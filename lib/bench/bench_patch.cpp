@@ -0,0 +1,18 @@
+//! A benchmark patch object. Compiled once per BENCH_PATCH_ID into its own shared library.
+//! The table of function pointers gives the loader some relocation work, like a real world patch would.
+
+#define BENCH_CAT(a, b) a##b
+#define BENCH_NAME(a, b) BENCH_CAT(a, b)
+
+static int bench_value(int x) { return x * 2 + BENCH_PATCH_ID; }
+
+#define BENCH_PTR4 &bench_value, &bench_value, &bench_value, &bench_value
+#define BENCH_PTR16 BENCH_PTR4, BENCH_PTR4, BENCH_PTR4, BENCH_PTR4
+#define BENCH_PTR256 BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, \
+    BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16, BENCH_PTR16
+
+int (*bench_table[])(int) = {BENCH_PTR256, BENCH_PTR256, BENCH_PTR256, BENCH_PTR256};
+
+extern "C" int BENCH_NAME(bench_patch_, BENCH_PATCH_ID)(int x) {
+    return bench_table[x & 1023](x);
+}
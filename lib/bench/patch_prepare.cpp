@@ -0,0 +1,93 @@
+//! Measures the wall-clock time of patch_now for BENCH_PATCH_COUNT independent patch files,
+//! for an increasing number of preparation workers.
+//!
+//! Usage: PatchPrepareBench [max_workers] [repetitions]
+
+#include "runtime_patching_lib.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+/// The functions that get patched. Kept big enough for a 64bit jump.
+template<size_t I>
+FORCE_NO_INLINE int bench_target(int x) {
+    volatile int v = x;
+    for (int i = 0; i < 3; ++i) {
+        v = v * 3 + (int) I;
+    }
+    return v;
+}
+
+template<size_t... I>
+Patchables make_patchables(std::index_sequence<I...>) {
+    Patchables patchables;
+    (patchables.emplace_back(Patchable{
+            .address = reinterpret_cast<void *>(&bench_target<I>),
+            .symbol_name = "bench_patch_" + std::to_string(I)}), ...);
+    return patchables;
+}
+
+/// Copies the patch objects into a fresh directory, so that the dynamic loader has to load them again,
+/// and writes a registry for them.
+static fs::path make_registry(const fs::path &dir, int version) {
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    std::ofstream meta(dir / "meta.json");
+    meta << "[";
+    for (int i = 0; i < BENCH_PATCH_COUNT; ++i) {
+        auto name = "bench_patch_" + std::to_string(i);
+        fs::copy_file(fs::path(BENCH_PATCH_DIR) / (name + ".so"), dir / (name + ".so"));
+        meta << (i ? "," : "") << R"({"new_version": )" << version << R"(, "about": "", "symbol_name": ")" << name
+             << R"(", "patch_file": ")" << (dir / (name + ".so")).string() << R"("})";
+    }
+    meta << "]";
+    return dir / "meta.json";
+}
+
+int main(int argc, char **argv) {
+    unsigned max_workers = argc > 1 ? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+    int repetitions = argc > 2 ? std::stoi(argv[2]) : 5;
+    auto base_dir = fs::temp_directory_path() / "runtime_patching_bench";
+
+    std::cout << BENCH_PATCH_COUNT << " patch files, best of " << repetitions << "\n";
+    std::cout << std::setw(8) << "workers" << std::setw(12) << "time [ms]" << std::setw(10) << "speedup" << "\n";
+
+    auto clog_buffer = std::clog.rdbuf(nullptr);
+    int version = 0;
+    double single_worker_ms = 0;
+    for (unsigned workers = 1; workers <= max_workers; workers *= 2) {
+        double best_ms = 0;
+        for (int r = 0; r < repetitions; ++r) {
+            ++version;
+            auto meta = make_registry(base_dir / std::to_string(version), version);
+            PatchRegistry registry(meta.string());
+            auto patchables = make_patchables(std::make_index_sequence<BENCH_PATCH_COUNT>{});
+
+            auto start = std::chrono::steady_clock::now();
+            patch_now(patchables, registry, workers);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best_ms = r ? std::min(best_ms, elapsed.count()) : elapsed.count();
+        }
+        if (workers == 1) {
+            single_worker_ms = best_ms;
+        }
+        std::cout << std::setw(8) << workers << std::setw(12) << std::fixed << std::setprecision(3) << best_ms
+                  << std::setw(10) << std::setprecision(2) << single_worker_ms / best_ms << "\n";
+    }
+    std::clog.rdbuf(clog_buffer);
+    fs::remove_all(base_dir);
+
+    // The patched function doubles its argument and adds the patch id
+    if (bench_target<1>(20) != 41) {
+        std::cerr << "Patch was not applied!\n";
+        return 1;
+    }
+    return 0;
+}
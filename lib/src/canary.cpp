@@ -0,0 +1,294 @@
+#include "runtime_patching_lib.h"
+#include "elf_symbols.h"
+#include "lde_minimal.h"
+#include "patchability.h"
+#include "make_jmp.h"
+#include "patch_bundle.h"
+
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+#define NOP_OPCODE  0x90
+
+uint64_t LatencyHistogram::count() const {
+    uint64_t sum = 0;
+    for (auto bucket: buckets) {
+        sum += bucket;
+    }
+    return sum;
+}
+
+uint64_t LatencyHistogram::quantile_ns(double q) const {
+    auto total = count();
+    if (!total) {
+        return 0;
+    }
+    auto rank = std::max<uint64_t>(1, (uint64_t) std::ceil(q * double(total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return uint64_t(2) << i;
+        }
+    }
+    return uint64_t(2) << (buckets.size() - 1);
+}
+
+void Canary::set_fraction(double fraction) {
+    fraction = std::clamp(fraction, 0.0, 1.0);
+    threshold.store(uint64_t(fraction * double(uint64_t(1) << 32)), std::memory_order_relaxed);
+}
+
+void Canary::route_current_thread(CanaryRoute route) {
+    thread_state().route = route;
+}
+
+CanaryThreadState &Canary::thread_state() {
+    // Usually a single canary runs at a time, so a linear search is fastest
+    thread_local std::vector<std::pair<const Canary *, CanaryThreadState *>> states;
+    for (auto &state: states) {
+        if (state.first == this) {
+            return *state.second;
+        }
+    }
+
+    // Never freed, so that the histograms of finished threads are kept
+    auto state = new CanaryThreadState();
+    state->random = (uintptr_t) state ^ (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+    state->random |= 1;
+    state->next = threads.load(std::memory_order_relaxed);
+    while (!threads.compare_exchange_weak(state->next, state, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    states.emplace_back(this, state);
+    return *state;
+}
+
+auto Canary::report() const -> CanaryReport {
+    CanaryReport report;
+    for (auto state = threads.load(std::memory_order_acquire); state; state = state->next) {
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+            report.original.buckets[i] += state->buckets[0][i].load(std::memory_order_relaxed);
+            report.patched.buckets[i] += state->buckets[1][i].load(std::memory_order_relaxed);
+        }
+    }
+    return report;
+}
+
+/// Makes all pages of [address, address + size) writable, calls `write` and makes them executable again.
+template<class F>
+static auto write_code(void *address, size_t size, F write) -> Result<bool> {
+    auto page_size = (uintptr_t) getpagesize();
+    auto first = (uintptr_t) address & ~(page_size - 1);
+    auto last = ((uintptr_t) address + size + page_size - 1) & ~(page_size - 1);
+    if (mprotect((void *) first, last - first, PROT_WRITE | PROT_READ | PROT_EXEC)) {
+        return Result<bool>(std::in_place_index<1>, "mprotect failed. Please disable seccomp, SELinux, AppArmor");
+    }
+    write((uint8_t *) address);
+    if (mprotect((void *) first, last - first, PROT_READ | PROT_EXEC)) {
+        return Result<bool>(std::in_place_index<1>, "mprotect failed. Please disable seccomp, SELinux, AppArmor");
+    }
+    return Result<bool>(std::in_place_index<0>, true);
+}
+
+/// Writes a jump to `destination` over the first `size` bytes of `address` and fills the rest with NOPs.
+static auto redirect(void *address, size_t size, void *destination) -> Result<bool> {
+    return write_code(address, size, [&](uint8_t *code) {
+        make_jmp(code, destination);
+        for (size_t i = get_jmp_size(code, destination); i < size; ++i) {
+            code[i] = NOP_OPCODE;
+        }
+    });
+}
+
+auto Canary::check_running() const -> Result<bool> {
+    if (finished) {
+        return Result<bool>(std::in_place_index<1>, "The canary has already finished");
+    }
+    if (read_jmp_destination(patchable->address) != dispatcher) {
+        return Result<bool>(std::in_place_index<1>, "The function prologue no longer jumps to the canary dispatcher");
+    }
+    return Result<bool>(true);
+}
+
+auto Canary::promote() -> Result<bool> {
+    auto running = check_running();
+    if (running.index() != 0) {
+        return running;
+    }
+    auto result = redirect(patchable->address, original_bytes.size(), patched);
+    if (result.index() == 0) {
+        finished = true;
+        patchable->canary_running = false;
+        std::clog << "Promoted " << patchable->symbol_name << " to " << new_version << "\n";
+    }
+    return result;
+}
+
+auto Canary::abort() -> Result<bool> {
+    auto running = check_running();
+    if (running.index() != 0) {
+        return running;
+    }
+    auto result = write_code(patchable->address, original_bytes.size(), [&](uint8_t *code) {
+        memcpy(code, original_bytes.data(), original_bytes.size());
+    });
+    if (result.index() == 0) {
+        finished = true;
+        patchable->canary_running = false;
+        patchable->current_version = old_version;
+        std::clog << "Aborted canary of " << patchable->symbol_name << "\n";
+    }
+    return result;
+}
+
+/// Allocates executable memory within the reach of a 32bit relative jump from `near`, or returns nullptr.
+static uint8_t *allocate_near(void *near, size_t size) {
+    auto page_size = (uintptr_t) getpagesize();
+    auto base = (uintptr_t) near & ~(page_size - 1);
+    // mmap treats the address as a hint, so probe with growing distances on both sides
+    for (uintptr_t distance = 1 << 20; distance < (uintptr_t(1) << 31); distance *= 2) {
+        for (auto hint: {base - distance, base + distance}) {
+            auto memory = mmap((void *) hint, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                continue;
+            }
+            auto offset = (intptr_t) memory - (intptr_t) near;
+            if (offset > INT32_MIN / 2 && offset < INT32_MAX / 2) {
+                return (uint8_t *) memory;
+            }
+            munmap(memory, size);
+        }
+    }
+    return nullptr;
+}
+
+/// Copies the overwritten prologue of `function` to a stub, adjusts relative operands for the new location
+/// and appends a jump back to the rest of the function. Returns nullptr if the stub cannot reach the function.
+static void *relocate_prologue(const uint8_t *function, const FunctionPatchability &f) {
+    auto stub = allocate_near((void *) function, getpagesize());
+    if (!stub) {
+        return nullptr;
+    }
+    memcpy(stub, function, f.jmp64_overwrite);
+    for (size_t i = 0; i < f.reloc_count; ++i) {
+        int32_t operand;
+        memcpy(&operand, stub + f.reloc_offsets[i], sizeof(operand));
+        int64_t relocated = int64_t(operand) + ((intptr_t) function - (intptr_t) stub);
+        if (relocated < INT32_MIN || relocated > INT32_MAX) {
+            munmap(stub, getpagesize());
+            return nullptr;
+        }
+        operand = (int32_t) relocated;
+        memcpy(stub + f.reloc_offsets[i], &operand, sizeof(operand));
+    }
+    make_jmp(stub + f.jmp64_overwrite, (void *) (function + f.jmp64_overwrite));
+    mprotect(stub, getpagesize(), PROT_READ | PROT_EXEC);
+    return stub;
+}
+
+auto install_canary(Patchable &patchable, PatchRegistry &patch_registry, double fraction, void *dispatcher,
+                    std::atomic<Canary *> &dispatcher_canary) -> Result<Canary *> {
+    using CanaryResult = Result<Canary *>;
+    if (patchable.vtable_index >= 0) {
+        return CanaryResult(std::in_place_index<1>, "Virtual member functions are not supported");
+    }
+    if (auto running = dispatcher_canary.load(); running && !running->finished) {
+        return CanaryResult(std::in_place_index<1>, "A canary for this function has already been started");
+    }
+
+    auto cache_result = patch_registry.get_patch_directory();
+    auto cache = std::get_if<PatchRegistry::cache_pointer>(&cache_result);
+    if (!cache) {
+        return CanaryResult(std::in_place_index<1>, "Failed to get registry cache pointer");
+    }
+    const Patch *patch = nullptr;
+    for (auto &cache_entry: **cache) {
+        if (cache_entry.symbol_name == patchable.symbol_name && cache_entry.expanded_from.empty()
+            && cache_entry.new_version > patchable.current_version
+            && (!patch || patch->new_version < cache_entry.new_version)) {
+            patch = &cache_entry;
+        }
+    }
+    if (!patch) {
+        return CanaryResult(std::in_place_index<1>, "No newer patch in the registry");
+    }
+    // Promoting must not revert the fixes of inlined copies that have been applied to the function
+    for (auto &[expanded_from, version]: patchable.expansions) {
+        if (std::none_of((*cache)->begin(), (*cache)->end(), [&](const Patch &entry) {
+            return entry.symbol_name == patchable.symbol_name && entry.expanded_from == expanded_from
+                   && entry.patch_file == patch->patch_file && entry.new_version >= version;
+        })) {
+            return CanaryResult(std::in_place_index<1>, "The patch object lacks an applied fix of an inlined copy");
+        }
+    }
+
+    fs::path patch_file = fs::current_path() / patch->patch_file;
+    auto handle = dlopen(patch_file.c_str(), RTLD_NOW);
+    if (!handle) {
+        return CanaryResult(std::in_place_index<1>, "Failed to load shared library");
+    }
+    release_materialised(patch->patch_file, handle);
+    auto patched_function = dlsym(handle, patch->symbol_name.c_str());
+    if (!patched_function) {
+        return CanaryResult(std::in_place_index<1>, "dlsym failed");
+    }
+
+    // Promoting may need a 64bit jump, so the 64bit overwrite range is relocated and replaced in all cases.
+    // The size keeps the jump from overwriting the following function.
+    auto symbol = find_elf_function(patchable.address);
+    if (auto error = std::get_if<std::string_view>(&symbol)) {
+        return CanaryResult(std::in_place_index<1>, *error);
+    }
+    auto function = (const uint8_t *) patchable.address;
+    FunctionPatchability f;
+    f.size = std::get<ElfFunction>(symbol).size - ((uintptr_t) function - std::get<ElfFunction>(symbol).address);
+    uint8_t code[sizeof(Jmp64Insn) + 2 * MAX_INSN_LEN] = {};
+    memcpy(code, function, std::min<size_t>(sizeof(code), f.size));
+    analyse_prologue(code, f);
+    if (f.decoded < sizeof(Jmp64Insn)) {
+        return CanaryResult(std::in_place_index<1>, "The function prologue is unknown to the length disassembler");
+    }
+    if (!f.jmp64_overwrite) {
+        return CanaryResult(std::in_place_index<1>, "The function is too small for a 64bit jump");
+    }
+    auto original = relocate_prologue(function, f);
+    if (!original) {
+        return CanaryResult(std::in_place_index<1>, "Failed to relocate the function prologue");
+    }
+
+    auto canary = new Canary();
+    canary->original = original;
+    canary->patched = patched_function;
+    canary->set_fraction(fraction);
+    canary->patchable = &patchable;
+    canary->dispatcher = dispatcher;
+    canary->new_version = patch->new_version;
+    canary->old_version = patchable.current_version;
+    canary->original_bytes.assign(function, function + f.jmp64_overwrite);
+    dispatcher_canary.store(canary, std::memory_order_release);
+
+    auto redirected = redirect(patchable.address, f.jmp64_overwrite, dispatcher);
+    if (auto error = std::get_if<std::string_view>(&redirected)) {
+        // The stub and the canary are only unreachable if the jump has not been written before the failure
+        if (!memcmp(function, canary->original_bytes.data(), canary->original_bytes.size())) {
+            dispatcher_canary.store(nullptr);
+            munmap(original, getpagesize());
+            delete canary;
+        }
+        return CanaryResult(std::in_place_index<1>, *error);
+    }
+    // ::patch_now must not overwrite the running canary
+    patchable.current_version = patch->new_version;
+    patchable.canary_running = true;
+    std::clog << "Started canary of " << patchable.symbol_name << " version " << patch->new_version << "\n";
+    return CanaryResult(std::in_place_index<0>, canary);
+}
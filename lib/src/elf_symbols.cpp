@@ -0,0 +1,251 @@
+#include "elf_symbols.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+
+/// Finds the NT_GNU_BUILD_ID note and returns its description as hex string
+static string read_build_id(const uint8_t *data, size_t size, const Elf64_Shdr *sections, int section_count) {
+    for (int i = 0; i < section_count; ++i) {
+        auto &section = sections[i];
+        if (section.sh_type != SHT_NOTE || section.sh_offset + section.sh_size > size) {
+            continue;
+        }
+        // Notes are a sequence of headers, each followed by the 4 byte aligned name and description
+        for (size_t pos = 0; pos + sizeof(Elf64_Nhdr) <= section.sh_size;) {
+            auto note = (const Elf64_Nhdr *) (data + section.sh_offset + pos);
+            size_t name_size = (note->n_namesz + 3) & ~3u;
+            size_t desc_size = (note->n_descsz + 3) & ~3u;
+            auto name = (const char *) (note + 1);
+            auto desc = (const uint8_t *) name + name_size;
+            if (pos + sizeof(Elf64_Nhdr) + name_size + desc_size > section.sh_size) {
+                break;
+            }
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                string build_id;
+                for (size_t b = 0; b < note->n_descsz; ++b) {
+                    const char hex[] = "0123456789abcdef";
+                    build_id += hex[desc[b] >> 4];
+                    build_id += hex[desc[b] & 15];
+                }
+                return build_id;
+            }
+            pos += sizeof(Elf64_Nhdr) + name_size + desc_size;
+        }
+    }
+    return {};
+}
+
+auto read_elf_functions(const string &elf_file, bool with_functions) -> Result<ElfFunctions> {
+    int fd = open(elf_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Result<ElfFunctions>(std::in_place_index<1>, "File not found");
+    }
+    struct stat st{};
+    void *mapping = MAP_FAILED;
+    if (!fstat(fd, &st) && size_t(st.st_size) >= sizeof(Elf64_Ehdr)) {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return Result<ElfFunctions>(std::in_place_index<1>, "Not an ELF file");
+    }
+    auto data = (const uint8_t *) mapping;
+    size_t size = st.st_size;
+
+    auto result = [&]() -> Result<ElfFunctions> {
+        auto ehdr = (const Elf64_Ehdr *) data;
+        if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+            return Result<ElfFunctions>(std::in_place_index<1>, "Not a 64bit ELF file");
+        }
+        if (ehdr->e_shoff + uint64_t(ehdr->e_shnum) * sizeof(Elf64_Shdr) > size) {
+            return Result<ElfFunctions>(std::in_place_index<1>, "Truncated ELF file");
+        }
+        auto sections = (const Elf64_Shdr *) (data + ehdr->e_shoff);
+
+        ElfFunctions functions;
+        functions.position_independent = ehdr->e_type == ET_DYN;
+        functions.build_id = read_build_id(data, size, sections, ehdr->e_shnum);
+        if (!with_functions) {
+            return Result<ElfFunctions>(std::in_place_index<0>, std::move(functions));
+        }
+
+        const Elf64_Shdr *symtab = nullptr;
+        for (int i = 0; i < ehdr->e_shnum; ++i) {
+            if (sections[i].sh_type == SHT_SYMTAB || (!symtab && sections[i].sh_type == SHT_DYNSYM)) {
+                symtab = &sections[i];
+            }
+        }
+        if (!symtab || symtab->sh_link >= ehdr->e_shnum) {
+            return Result<ElfFunctions>(std::in_place_index<1>, "No symbol table");
+        }
+        auto &strtab = sections[symtab->sh_link];
+        if (symtab->sh_offset + symtab->sh_size > size || strtab.sh_offset + strtab.sh_size > size) {
+            return Result<ElfFunctions>(std::in_place_index<1>, "Truncated ELF file");
+        }
+
+        auto symbols = (const Elf64_Sym *) (data + symtab->sh_offset);
+        auto names = (const char *) (data + strtab.sh_offset);
+        for (size_t i = 0; i < symtab->sh_size / sizeof(Elf64_Sym); ++i) {
+            auto &sym = symbols[i];
+            if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC || sym.st_shndx == SHN_UNDEF || sym.st_name >= strtab.sh_size) {
+                continue;
+            }
+            uint64_t file_offset = 0;
+            if (sym.st_shndx < ehdr->e_shnum) {
+                auto &section = sections[sym.st_shndx];
+                if (section.sh_type != SHT_NOBITS && sym.st_value >= section.sh_addr
+                    && sym.st_value < section.sh_addr + section.sh_size) {
+                    file_offset = section.sh_offset + (sym.st_value - section.sh_addr);
+                }
+            }
+            functions.functions.push_back(ElfFunction{
+                    .name = string(names + sym.st_name, strnlen(names + sym.st_name, strtab.sh_size - sym.st_name)),
+                    .address = sym.st_value,
+                    .size = sym.st_size,
+                    .file_offset = file_offset,
+            });
+        }
+        return Result<ElfFunctions>(std::in_place_index<0>, std::move(functions));
+    }();
+    munmap(mapping, size);
+    return result;
+}
+
+uintptr_t find_mapping_base(pid_t pid, const string &file) {
+    struct stat st{};
+    if (stat(file.c_str(), &st)) {
+        return 0;
+    }
+
+    // Lines look like: 55d4c5e00000-55d4c5e02000 r--p 00000000 08:01 1234567 /usr/bin/app
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    string line;
+    while (std::getline(maps, line)) {
+        std::istringstream ss(line);
+        string range, perms, offset, device;
+        ino_t inode = 0;
+        ss >> range >> perms >> offset >> device >> inode;
+        auto colon = device.find(':');
+        if (inode != st.st_ino || colon == string::npos || std::stoul(offset, nullptr, 16) != 0) {
+            continue;
+        }
+        auto dev = makedev(std::stoul(device.substr(0, colon), nullptr, 16),
+                           std::stoul(device.substr(colon + 1), nullptr, 16));
+        if (dev == st.st_dev) {
+            return std::stoul(range, nullptr, 16);
+        }
+    }
+    return 0;
+}
+
+std::vector<MemoryMapping> read_memory_mappings() {
+    std::vector<MemoryMapping> mappings;
+    // Lines look like: 55d4c5e00000-55d4c5e02000 r-xp 00002000 08:01 1234567 /usr/bin/app
+    std::ifstream maps("/proc/self/maps");
+    string line;
+    while (std::getline(maps, line)) {
+        std::istringstream ss(line);
+        string range, perms, offset, device, inode;
+        ss >> range >> perms >> offset >> device >> inode >> std::ws;
+        auto dash = range.find('-');
+        if (dash == string::npos || perms.size() < 3) {
+            continue;
+        }
+        MemoryMapping mapping;
+        mapping.start = std::stoul(range, nullptr, 16);
+        mapping.end = std::stoul(range.substr(dash + 1), nullptr, 16);
+        mapping.protection = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0)
+                             | (perms[2] == 'x' ? PROT_EXEC : 0);
+        std::getline(ss, mapping.file);
+        mappings.push_back(std::move(mapping));
+    }
+    return mappings;
+}
+
+const MemoryMapping *find_memory_mapping(const std::vector<MemoryMapping> &mappings, uintptr_t address) {
+    auto it = std::upper_bound(mappings.begin(), mappings.end(), address,
+                               [](uintptr_t a, const MemoryMapping &m) { return a < m.end; });
+    return it != mappings.end() && it->start <= address ? &*it : nullptr;
+}
+
+/// Returns the function of `functions` that contains the address, with the absolute address in this process
+static auto containing_function(const ElfFunctions &functions, uintptr_t base,
+                                const void *address) -> std::optional<ElfFunction> {
+    for (auto &function: functions.functions) {
+        auto start = base + function.address;
+        if ((uintptr_t) address >= start && (uintptr_t) address < start + function.size) {
+            auto result = function;
+            result.address += base;
+            return result;
+        }
+    }
+    return std::nullopt;
+}
+
+auto find_elf_function(const void *address) -> Result<ElfFunction> {
+    // The file that is mapped at the address
+    auto mappings = read_memory_mappings();
+    auto mapping = find_memory_mapping(mappings, (uintptr_t) address);
+    if (!mapping) {
+        return Result<ElfFunction>(std::in_place_index<1>, "The address is not mapped");
+    }
+    if (mapping->file.empty() || mapping->file[0] != '/') {
+        return Result<ElfFunction>(std::in_place_index<1>, "The address is not part of a mapped file");
+    }
+
+    auto elf = read_elf_functions(mapping->file);
+    if (auto error = std::get_if<std::string_view>(&elf)) {
+        return Result<ElfFunction>(std::in_place_index<1>, *error);
+    }
+    auto &functions = std::get<ElfFunctions>(elf);
+    uintptr_t base = 0;
+    if (functions.position_independent && !(base = find_mapping_base(getpid(), mapping->file))) {
+        return Result<ElfFunction>(std::in_place_index<1>, "Mapping of the file not found");
+    }
+    if (auto function = containing_function(functions, base, address)) {
+        return Result<ElfFunction>(std::in_place_index<0>, std::move(*function));
+    }
+    return Result<ElfFunction>(std::in_place_index<1>, "No function symbol contains the address");
+}
+
+std::vector<ElfFunction> find_elf_functions(const std::vector<const void *> &addresses) {
+    std::vector<ElfFunction> result(addresses.size());
+    if (addresses.empty()) {
+        return result;
+    }
+    auto mappings = read_memory_mappings();
+    // The symbols and load base of every file, read on first use. Empty if the file cannot be read.
+    std::map<string, std::pair<ElfFunctions, uintptr_t>> files;
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        auto mapping = find_memory_mapping(mappings, (uintptr_t) addresses[i]);
+        if (!mapping || mapping->file.empty() || mapping->file[0] != '/') {
+            continue;
+        }
+        auto file = files.find(mapping->file);
+        if (file == files.end()) {
+            auto elf = read_elf_functions(mapping->file);
+            auto &entry = files[mapping->file];
+            if (auto functions = std::get_if<ElfFunctions>(&elf)) {
+                entry.second = functions->position_independent ? find_mapping_base(getpid(), mapping->file) : 0;
+                if (!functions->position_independent || entry.second) {
+                    entry.first = std::move(*functions);
+                }
+            }
+            file = files.find(mapping->file);
+        }
+        if (auto function = containing_function(file->second.first, file->second.second, addresses[i])) {
+            result[i] = std::move(*function);
+        }
+    }
+    return result;
+}
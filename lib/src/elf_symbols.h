@@ -0,0 +1,56 @@
+///! A minimal reader for the function symbols of 64bit ELF files.
+#pragma once
+
+#include "runtime_patching_lib.h"
+
+#include <cstdint>
+#include <sys/types.h>
+
+struct ElfFunction {
+    string name;
+    /// The symbol value. Relative to the load base for position independent files.
+    uint64_t address;
+    uint64_t size;
+    /// Where the function code starts within the file. 0 if the code is not part of the file.
+    uint64_t file_offset;
+};
+
+struct ElfFunctions {
+    /// True for position independent files (ET_DYN). Symbol addresses need to be rebased by the load address.
+    bool position_independent = false;
+    /// The GNU build id as hex string. Empty if the file has none.
+    string build_id;
+    std::vector<ElfFunction> functions;
+};
+
+/// Reads all defined function symbols of the given ELF file. The static symbol table (.symtab) is used if present,
+/// the dynamic one (.dynsym) otherwise. Only the file type and build id are read if `with_functions` is false.
+auto read_elf_functions(const string &elf_file, bool with_functions = true) -> Result<ElfFunctions>;
+
+/// Returns the address the given file has been mapped at in the given process, or 0 if it has not been mapped.
+/// The file is identified by device and inode, so that differing paths (symlinks) do not matter.
+uintptr_t find_mapping_base(pid_t pid, const string &file);
+
+/// A memory mapping of this process, as listed in /proc/self/maps.
+struct MemoryMapping {
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    /// PROT_READ, PROT_WRITE and PROT_EXEC flags
+    int protection = 0;
+    /// The mapped file, or a pseudo name like [stack]. Empty for anonymous mappings.
+    string file;
+};
+
+/// Returns all memory mappings of this process, ordered by address.
+std::vector<MemoryMapping> read_memory_mappings();
+
+/// Returns the mapping that contains the address, or nullptr if it is not mapped.
+const MemoryMapping *find_memory_mapping(const std::vector<MemoryMapping> &mappings, uintptr_t address);
+
+/// Returns the function symbol of this process that contains the given code address. The symbol address is
+/// the absolute address in this process.
+auto find_elf_function(const void *address) -> Result<ElfFunction>;
+
+/// Like ::find_elf_function for many addresses, in the same order. Every ELF file is read once. Addresses that are
+/// not part of a function symbol get a function of size 0.
+std::vector<ElfFunction> find_elf_functions(const std::vector<const void *> &addresses);
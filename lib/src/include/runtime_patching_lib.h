@@ -2,9 +2,17 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <array>
+#include <deque>
+#include <cstdint>
 #include <chrono>
 #include <future>
 #include <optional>
+#include <tuple>
 #include <variant>
 
 using string = std::string;
@@ -33,23 +41,167 @@ struct Patch {
     /// The path to the binary fragment. This is expected to be a shared library (.so) filesystem URI in this implementation.
     /// It is task of the ::PatchRegistry to resolve non file system URIs to filesystem URIs.
     string patch_file;
+    /// The registry generation this entry was first seen in. Assigned by the ::PatchRegistry, monotonically increasing.
+    uint64_t generation=0;
+    /// Set for entries that the ::PatchRegistry added because the function contains an inlined copy or is a clone
+    /// of another patched function. The symbol name of that function.
+    string expanded_from = {};
 };
 
+/// A view on a consecutive range of registry entries. Invalidated by the next registry refresh.
+struct PatchRange {
+    const Patch* first = nullptr;
+    const Patch* last = nullptr;
+
+    const Patch* begin() const { return first; }
+    const Patch* end() const { return last; }
+    size_t size() const { return last - first; }
+};
+
+class PatchBundle;
+class PatchDaemonClient;
+
+/// The functions of an executable that contain a copy of another function, because GCC has inlined or cloned it
+/// (for example `.constprop` or `.isra` clones). A patch for a function has to replace all of those as well.
+struct InlineClosure {
+    /// For each function, all functions it has been inlined into or cloned to, directly or transitively.
+    /// Functions without copies are omitted.
+    std::map<string, std::set<string>> copies;
+};
+
+/// Computes the inline closure from the `-fdump-ipa-clones` output of GCC, one dump file per translation unit.
+/// Functions that GCC has removed after inlining all of their calls are not part of any copy set.
+/// Static functions are identified by name only, so equally named ones of different translation units are merged.
+auto read_ipa_clones(const std::vector<string> &dump_files) -> Result<InlineClosure>;
+
+/// Writes an inline closure as json object, that maps each symbol name to the array of its copies.
+auto write_inline_closure(const string &closure_file, const InlineClosure &closure) -> Result<bool>;
+
+/// Reads an inline closure written by ::write_inline_closure.
+auto load_inline_closure(const string &closure_file) -> Result<std::shared_ptr<const InlineClosure>>;
+
 /// The patch registry class. Contains a cached list of available patches.
+///
+/// The registry URI is either a json file, or a patch bundle (a ".bundle" file, see ::write_patch_bundle).
+/// A bundle is read with a single file open. Its patch objects are handed to the patcher as /proc/self/fd paths
+/// of in-memory files.
+/// A "unix:<socket path>" URI connects to a patch daemon (see ::run_patch_daemon) instead. The entries are then read
+/// from the daemons shared memory index, whenever the daemon has published a new one.
+///
+/// If an inline closure is given, every entry is expanded into one entry per copy of its function, with the same
+/// version and patch file. The patch object has to define all of those symbols.
+///
+/// Every entry gets a generation number when it is first seen. The cache only ever grows, and is ordered by generation,
+/// so that a consumer can ask for just the entries that appeared after the last generation it has processed.
 class PatchRegistry {
+public:
+    using generation_t = uint64_t;
 private:
     std::vector<Patch> cache;
+    /// (symbol_name, new_version) of all cached entries. Used to detect already known entries on a refresh.
+    std::set<std::pair<string, int>> known_entries;
+    /// (expanded_from, symbol_name, new_version) of all expanded entries, see ::InlineClosure
+    std::set<std::tuple<string, string, int>> known_expansions;
+    /// All bundles that have been read. They own the in-memory files of their patch objects.
+    std::vector<std::shared_ptr<PatchBundle>> bundles;
+    /// Set in daemon client mode
+    std::shared_ptr<PatchDaemonClient> daemon_client;
+    generation_t generation = 0;
     std::chrono::system_clock::time_point cache_time;
     std::string registry_uri;
+    std::shared_ptr<const InlineClosure> inline_closure;
+
+    /// Adds an entry to the cache, if it is not yet known, and assigns the next generation to it.
+    void add_entry(Patch &&patch);
 public:
-    explicit PatchRegistry(std::string registry_uri) noexcept ;
+    explicit PatchRegistry(std::string registry_uri,
+                           std::shared_ptr<const InlineClosure> inline_closure = nullptr) noexcept ;
 
     using cache_pointer = std::vector<Patch>*;
     /// This method returns the patch registry entries. Entries are cached. If the cache is older than 60 minutes
     /// it will be refreshed first.
     auto get_patch_directory() -> Result<cache_pointer>;
+
+    /// Returns all entries with a generation bigger than the given one. Refreshes the cache like #get_patch_directory.
+    /// Use 0 to get all entries.
+    auto get_patch_directory_since(generation_t since) -> Result<PatchRange>;
+
+    /// The generation of the newest cached entry. 0 if the cache is empty.
+    generation_t current_generation() const { return generation; }
+
+    /// Forces a refresh on the next access, regardless of the cache age.
+    void expire_cache() { cache_time = {}; }
+};
+
+/// Writes a patch bundle: A single file that contains the registry meta data and the given patch objects.
+/// Patch objects are stored under the given path, which is what the "patch_file" entries of the registry refer to.
+auto write_patch_bundle(const string &bundle_file, const string &registry_file,
+                        const std::vector<string> &patch_files) -> Result<bool>;
+
+/// Runs a patch daemon until `stop` is set. The daemon reads the registry and publishes its entries as a read-only
+/// shared memory index to all clients connected to the unix domain socket at `socket_path`.
+/// The registry is re-read and a new index is published whenever the registry file changes.
+/// Clients are ::PatchRegistry instances with a "unix:<socket path>" registry URI.
+auto run_patch_daemon(const string &registry_uri, const string &socket_path,
+                      const std::atomic<bool> &stop) -> Result<bool>;
+
+/// Patches another process from the outside, for binaries that do not link this library.
+/// All threads of the process are stopped via ptrace. For the newest registry entry of every function symbol
+/// of the process executable, the patch object is loaded by an injected `dlopen` call and the function prologue
+/// is overwritten with a jump. Requires ptrace permissions for the process.
+/// Functions whose prologue already jumps to the patch are skipped. Returns the number of applied patches.
+/// Stops with an error if an injected call times out, which leaves the process in an undefined state.
+auto patch_process(int pid, PatchRegistry &patch_registry) -> Result<int>;
+
+/// The maximum number of relative operands recorded per function prologue
+#define MAX_PROLOGUE_RELOCS 4
+
+/// Sizes of the 32bit (relative) and 64bit (absolute) jumps written into function prologues
+#define JMP32_SIZE 5
+#define JMP64_SIZE 14
+
+/// The patchability of a single function, computed once by ::load_patchability_map.
+struct FunctionPatchability {
+    string symbol_name;
+    /// The symbol address. Relative to the load base for position independent executables.
+    uint64_t address = 0;
+    /// The function size. 0 if unknown.
+    uint64_t size = 0;
+    /// Number of prologue bytes the length disassembler could decode, up to the size of a 64bit jump.
+    uint8_t decoded = 0;
+    /// Bytes that are overwritten by a 32bit (5 byte) or 64bit (14 byte) jump, up to the next instruction boundary.
+    /// 0 if the function cannot be patched with that jump.
+    uint8_t jmp32_overwrite = 0;
+    uint8_t jmp64_overwrite = 0;
+    /// Offsets of relative operands (call/jmp rel32, rip relative addressing) within the bytes overwritten
+    /// by a 64bit jump. Those need a fixup if the overwritten instructions are ever executed elsewhere.
+    uint8_t reloc_count = 0;
+    uint8_t reloc_offsets[MAX_PROLOGUE_RELOCS] = {};
+};
+
+/// The patchability of all functions of an executable.
+struct PatchabilityMap {
+    /// The GNU build id of the analysed executable
+    string build_id;
+    /// Where the analysed executable is mapped in this process. 0 if it is not mapped.
+    uintptr_t load_base = 0;
+    /// Ordered by address, then name. Aliases of a function have an entry each.
+    std::vector<FunctionPatchability> functions;
+    /// True if the map has been read from the on-disk cache instead of being analysed
+    bool from_cache = false;
+
+    /// Returns the entry for a function address of this process, or nullptr if the address is not a known function.
+    /// For aliases, the entry with the first name is returned.
+    const FunctionPatchability *find(const void *address) const;
 };
 
+/// Returns the patchability of all function symbols of the given executable. The result is cached on disk in
+/// $XDG_CACHE_HOME/runtime_patching (~/.cache/runtime_patching by default), keyed by the ELF build id, so that the
+/// analysis only runs once per build. If not cached, the function prologues are analysed on up to `workers` threads
+/// (0: one per hardware thread). Executables without build id are analysed but not cached.
+auto load_patchability_map(const string &elf_file = "/proc/self/exe",
+                           unsigned workers = 0) -> Result<std::shared_ptr<const PatchabilityMap>>;
+
 struct Patchable {
     /// The patchable functions pointer address. Vtable pointer for virtual member functions of classes.
     void* address;
@@ -59,12 +211,50 @@ struct Patchable {
     int current_version=0;
     /// The symbol name. Obtain it in a non standard way via typeid(&MyClass::my_method).name()
     string symbol_name;
+    /// The versions of the patched functions whose inlined copies or clones this function contains and whose fixes
+    /// have been applied, as (expanded_from, version) pairs. See ::InlineClosure. The function runs all of them
+    /// together with #current_version, so every later patch has to carry them too.
+    std::vector<std::pair<string, int>> expansions = {};
+    /// Set while a ::Canary of this function runs. ::patch_now defers its patches until the canary has finished.
+    bool canary_running = false;
 };
 
-using Patchables = std::vector<Patchable>;
+/// The patchable functions of this process.
+struct Patchables : public std::vector<Patchable> {
+    /// The registry generation that has already been processed by ::patch_now. Only newer entries are considered
+    /// by the next call, except for patchables that have been added since.
+    PatchRegistry::generation_t consumed_generation = 0;
+    /// The number of patchables the last ::patch_now call has seen. Patchables appended after those get all
+    /// registry entries.
+    size_t known_patchables = 0;
+    /// If set, jumps are planned from this map instead of disassembling the target prologues at patch time.
+    std::shared_ptr<const PatchabilityMap> patchability;
+    /// Entries that failed to apply because their patch object has not been deployed yet. Retried by the next
+    /// ::patch_now call, unless a newer entry for the same patchable has been applied. Other failures, like a
+    /// missing symbol or an unknown prologue, are logged once and dropped. Entries for functions with a running
+    /// canary wait here as well.
+    std::vector<Patch> pending;
+    /// Added by ::patch_now for registry entries that have been expanded to the inlined copies of a patched
+    /// function, one per containing function that is not a patchable of its own. Only Patchable::expansions is
+    /// tracked for them. A deque, so that adding copies never moves the patchables.
+    std::deque<Patchable> copies;
+};
 
 /// Patches all patchables if a matching entry in the patch registry could be found.
-void patch_now(Patchables& patchables, PatchRegistry& patch_registry);
+/// Only registry entries that have been added since the last call, and the pending entries of earlier calls,
+/// are processed. Patchables appended since the last call get all entries. Entries whose patch file does not exist
+/// yet are kept pending, as are entries for functions with a running canary.
+/// Registry entries that have been expanded to the inlined copies of a patched function (see ::InlineClosure)
+/// are applied to the patchable of the containing function, or to Patchables::copies if it is none. The addresses
+/// of copies are taken from the patchability map. A patch is refused if its patch object does not carry all fixes
+/// the function already runs, its own version and those of Patchable::expansions. A patch object carries the fixes
+/// of all registry entries that name it.
+///
+/// Patching happens in two stages. The patch objects are loaded, symbols resolved and jumps planned, one work item
+/// per patch file, on up to `workers` threads (0: one per hardware thread). By default this happens on the calling
+/// thread only, as `dlopen` is serialised by the loader lock anyway. See the PatchPrepareBench benchmark.
+/// Afterwards all jumps are written serially by the calling thread.
+void patch_now(Patchables& patchables, PatchRegistry& patch_registry, unsigned workers = 1);
 
 /// Determines the patchable address of a C++ class member function.
 /// Do not use this on virtual class members!
@@ -82,3 +272,185 @@ inline void *cpp_class_member_address(T2 v) {
     u.t2 = v;
     return u.t1;
 }
+
+/// Number of buckets of a ::LatencyHistogram. Bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds.
+#define LATENCY_BUCKETS 48
+
+struct LatencyHistogram {
+    std::array<uint64_t, LATENCY_BUCKETS> buckets{};
+
+    uint64_t count() const;
+    /// Returns the upper bound in nanoseconds of the bucket that contains the q-quantile (0 < q <= 1). 0 if empty.
+    uint64_t quantile_ns(double q) const;
+};
+
+/// Call latencies of both versions of a canary function
+struct CanaryReport {
+    LatencyHistogram original;
+    LatencyHistogram patched;
+};
+
+enum class CanaryRoute {
+    /// Calls go to the patched version with the probability configured by Canary::set_fraction
+    ByFraction,
+    Original,
+    Patched,
+};
+
+/// Per thread state of a ::Canary. Written by its thread only, so recording a call needs no locks or atomic
+/// read-modify-write operations. Read concurrently by Canary::report.
+struct CanaryThreadState {
+    std::atomic<uint64_t> buckets[2][LATENCY_BUCKETS] = {};
+    uint64_t random = 0;
+    CanaryRoute route = CanaryRoute::ByFraction;
+    CanaryThreadState *next = nullptr;
+};
+
+/// An A/B test of a patch in production. See ::start_canary.
+///
+/// Canaries, and the code they have allocated, are never freed, as other threads might still execute a dispatcher.
+class Canary {
+public:
+    /// The entry points of both versions. `original` is a relocated copy of the original prologue, followed by
+    /// a jump to the rest of the original function.
+    void *original = nullptr;
+    void *patched = nullptr;
+
+    /// Sets the fraction (0..1) of calls that go to the patched version. Threads can override this with
+    /// #route_current_thread.
+    void set_fraction(double fraction);
+
+    /// Routes all calls of the calling thread to one version, or back to the fraction based choice.
+    void route_current_thread(CanaryRoute route);
+
+    /// Sums up the latency histograms of all threads.
+    auto report() const -> CanaryReport;
+
+    /// Ends the canary in favour of the patched version: The function jumps straight to it from now on.
+    /// Fails if the prologue no longer jumps to the dispatcher.
+    auto promote() -> Result<bool>;
+
+    /// Ends the canary and restores the original function. Fails if the prologue no longer jumps to the dispatcher.
+    auto abort() -> Result<bool>;
+
+    /// The calling thread's state. Used by the dispatcher.
+    CanaryThreadState &thread_state();
+
+    /// Chooses the version for the next call. Used by the dispatcher.
+    bool choose_patched(CanaryThreadState &state) const {
+        if (state.route != CanaryRoute::ByFraction) {
+            return state.route == CanaryRoute::Patched;
+        }
+        // xorshift64
+        state.random ^= state.random << 13;
+        state.random ^= state.random >> 7;
+        state.random ^= state.random << 17;
+        return (state.random >> 32) < threshold.load(std::memory_order_relaxed);
+    }
+
+    /// Records the latency of a call. Used by the dispatcher.
+    static void record(CanaryThreadState &state, bool patched, std::chrono::nanoseconds latency) {
+        auto ns = uint64_t(latency.count()) | 1;
+        size_t bucket = std::min<size_t>(63 - __builtin_clzll(ns), LATENCY_BUCKETS - 1);
+        auto &counter = state.buckets[patched][bucket];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+private:
+    /// fraction * 2^32
+    std::atomic<uint64_t> threshold{0};
+    std::atomic<CanaryThreadState *> threads{nullptr};
+    Patchable *patchable = nullptr;
+    /// The dispatcher the function prologue jumps to while the canary runs
+    void *dispatcher = nullptr;
+    int new_version = 0;
+    int old_version = 0;
+    /// The original prologue bytes that are overwritten by the jump to the dispatcher
+    std::vector<uint8_t> original_bytes;
+    bool finished = false;
+
+    /// Checks that the canary can still be ended, and that nothing else has rewritten the prologue since.
+    auto check_running() const -> Result<bool>;
+
+    friend auto install_canary(Patchable &, PatchRegistry &, double, void *,
+                               std::atomic<Canary *> &) -> Result<Canary *>;
+};
+
+namespace canary_detail {
+    /// Measures a call from construction to destruction
+    struct CallTimer {
+        CanaryThreadState &state;
+        bool patched;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        ~CallTimer() {
+            Canary::record(state, patched, std::chrono::steady_clock::now() - start);
+        }
+    };
+
+    /// The dispatcher has the signature of the canary function. It chooses a version, calls it and records
+    /// the latency. One instance exists per canary function.
+    template<auto Function>
+    struct Dispatch;
+
+    template<class R, class... Args, R (*Function)(Args...)>
+    struct Dispatch<Function> {
+        static inline std::atomic<Canary *> canary{nullptr};
+
+        static R dispatch(Args... args) {
+            auto c = canary.load(std::memory_order_acquire);
+            auto &state = c->thread_state();
+            bool patched = c->choose_patched(state);
+            CallTimer timer{state, patched};
+            return ((R (*)(Args...)) (patched ? c->patched : c->original))(std::forward<Args>(args)...);
+        }
+    };
+
+    /// Non-virtual member functions receive `this` as first argument
+    template<class R, class C, class... Args, R (C::*Function)(Args...)>
+    struct Dispatch<Function> {
+        static inline std::atomic<Canary *> canary{nullptr};
+
+        static R dispatch(C *self, Args... args) {
+            auto c = canary.load(std::memory_order_acquire);
+            auto &state = c->thread_state();
+            bool patched = c->choose_patched(state);
+            CallTimer timer{state, patched};
+            return ((R (*)(C *, Args...)) (patched ? c->patched : c->original))(self, std::forward<Args>(args)...);
+        }
+    };
+
+    template<class R, class C, class... Args, R (C::*Function)(Args...) const>
+    struct Dispatch<Function> {
+        static inline std::atomic<Canary *> canary{nullptr};
+
+        static R dispatch(const C *self, Args... args) {
+            auto c = canary.load(std::memory_order_acquire);
+            auto &state = c->thread_state();
+            bool patched = c->choose_patched(state);
+            CallTimer timer{state, patched};
+            return ((R (*)(const C *, Args...)) (patched ? c->patched : c->original))(self,
+                                                                                      std::forward<Args>(args)...);
+        }
+    };
+}
+
+/// Installs a canary with the given dispatcher. Use ::start_canary instead.
+auto install_canary(Patchable &patchable, PatchRegistry &patch_registry, double fraction, void *dispatcher,
+                    std::atomic<Canary *> &dispatcher_canary) -> Result<Canary *>;
+
+/// Starts an A/B test of the newest registry patch for the given patchable, instead of patching it right away.
+///
+/// The patch object is loaded and the original prologue is relocated, so that the original version stays callable.
+/// The function is then redirected to a dispatcher that sends the given fraction of calls to the patched version
+/// and the rest to the original one, and records the call latencies per version. End the canary with
+/// Canary::promote or Canary::abort. The patchable must not move in memory while the canary runs.
+///
+/// `Function` must be the patchable function itself, like `&say_hello_fun` or `&DemoClass::say_hello`.
+/// It provides the signature of the dispatcher. Virtual member functions are not supported. The function must have
+/// a symbol in its ELF file, whose size shows that the 64bit jump fits.
+template<auto Function>
+auto start_canary(Patchable &patchable, PatchRegistry &patch_registry, double fraction) -> Result<Canary *> {
+    using D = canary_detail::Dispatch<Function>;
+    return install_canary(patchable, patch_registry, fraction, (void *) &D::dispatch, D::canary);
+}
@@ -0,0 +1,109 @@
+#include "runtime_patching_lib.h"
+#include "vendor/json.hpp"
+
+#include <fstream>
+#include <sstream>
+
+using namespace nlohmann;
+
+/* Lines of a -fdump-ipa-clones dump look like:
+ *   Callgraph clone;<name>;<order>;<file>;<line>;<column>;<clone name>;<order>;<file>;<line>;<column>;<reason>
+ *   Callgraph removal;<name>;<order>;<file>;<line>;<column>
+ * For inlining, the clone is named after the function the copy has been inlined to. The reason is "inlining to".
+ * Other reasons (constprop, isra, part, ...) name the new clone function.
+ */
+#define IPA_CLONE_PREFIX   "Callgraph clone;"
+#define IPA_REMOVAL_PREFIX "Callgraph removal;"
+
+static std::vector<string> split(const string &line, char separator) {
+    std::vector<string> fields;
+    std::istringstream ss(line);
+    for (string field; std::getline(ss, field, separator);) {
+        fields.push_back(std::move(field));
+    }
+    return fields;
+}
+
+auto read_ipa_clones(const std::vector<string> &dump_files) -> Result<InlineClosure> {
+    std::map<string, std::set<string>> edges;
+    // A function is gone if it has been removed in every translation unit that mentions it
+    std::set<string> removed, kept;
+    for (auto &dump_file: dump_files) {
+        std::ifstream i(dump_file);
+        if (!i) {
+            return Result<InlineClosure>(std::in_place_index<1>, "File not found");
+        }
+        std::set<string> removed_here, mentioned_here;
+        for (string line; std::getline(i, line);) {
+            auto fields = split(line, ';');
+            if (line.rfind(IPA_CLONE_PREFIX, 0) == 0 && fields.size() >= 12) {
+                if (fields[1] != fields[6]) {
+                    edges[fields[1]].insert(fields[6]);
+                }
+                mentioned_here.insert(fields[1]);
+                mentioned_here.insert(fields[6]);
+            } else if (line.rfind(IPA_REMOVAL_PREFIX, 0) == 0 && fields.size() >= 6) {
+                removed_here.insert(fields[1]);
+                mentioned_here.insert(fields[1]);
+            }
+        }
+        for (auto &name: mentioned_here) {
+            (removed_here.count(name) ? removed : kept).insert(name);
+        }
+    }
+
+    InlineClosure closure;
+    for (auto &edge: edges) {
+        // Copies can be inlined or cloned again, so follow the edges transitively
+        std::set<string> visited{edge.first};
+        std::vector<string> pending(edge.second.begin(), edge.second.end());
+        auto &copies = closure.copies[edge.first];
+        while (!pending.empty()) {
+            auto name = std::move(pending.back());
+            pending.pop_back();
+            if (!visited.insert(name).second) {
+                continue;
+            }
+            if (!removed.count(name) || kept.count(name)) {
+                copies.insert(name);
+            }
+            if (auto next = edges.find(name); next != edges.end()) {
+                pending.insert(pending.end(), next->second.begin(), next->second.end());
+            }
+        }
+        if (copies.empty()) {
+            closure.copies.erase(edge.first);
+        }
+    }
+    return Result<InlineClosure>(std::in_place_index<0>, std::move(closure));
+}
+
+auto write_inline_closure(const string &closure_file, const InlineClosure &closure) -> Result<bool> {
+    json j = json::object();
+    for (auto &entry: closure.copies) {
+        j[entry.first] = entry.second;
+    }
+    std::ofstream o(closure_file, std::ios::trunc);
+    o << j.dump(2) << "\n";
+    if (!o) {
+        return Result<bool>(std::in_place_index<1>, "Failed to write file");
+    }
+    return Result<bool>(std::in_place_index<0>, true);
+}
+
+auto load_inline_closure(const string &closure_file) -> Result<std::shared_ptr<const InlineClosure>> {
+    using ClosureResult = Result<std::shared_ptr<const InlineClosure>>;
+    std::ifstream i(closure_file);
+    if (!i) {
+        return ClosureResult(std::in_place_index<1>, "File not found");
+    }
+    auto j = json::parse(i, nullptr, false);
+    if (j.is_discarded() || !j.is_object()) {
+        return ClosureResult(std::in_place_index<1>, "Invalid inline closure file");
+    }
+    auto closure = std::make_shared<InlineClosure>();
+    for (auto &entry: j.items()) {
+        closure->copies[entry.key()] = entry.value().get<std::set<string>>();
+    }
+    return ClosureResult(std::in_place_index<0>, std::move(closure));
+}
@@ -1,5 +1,7 @@
 #include "lde_minimal.h"
 
+#include <algorithm>
+
 enum flags {
     MODRM = 1,
     PLUS_R = 1 << 1,
@@ -277,8 +279,8 @@ auto disasm(void *src) -> std::tuple<int, int> {
             }
         }
 
-        if (rm == 5) {
-            reloc_op_offset = (int32_t) len; /* RIP-relative addressing */
+        if (mod == 0 && rm == 5) {
+            reloc_op_offset = (int32_t) len; /* RIP-relative addressing, [rbp + disp] otherwise */
         }
 
         if (mod == 1) {
@@ -317,4 +319,5 @@ int disasm_until(void *src, int min_len) {
 
         orig_size += insn_len;
     }
-}
\ No newline at end of file
+    return orig_size;
+}
@@ -1,5 +1,7 @@
 ///! A simple length disassmebler engine (LDE) that works only with most common prologue instructions like push, mov, call, etc.
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <tuple>
 
 /// maximum length of x86 instruction
@@ -14,4 +16,4 @@ auto disasm(void *src) -> std::tuple<int, int>;
 
 /// Disassembles instructions at a given address to determine how many instructions need be erased (replaced by nop)
 /// after a jump has been inserted.
-int disasm_until(void* src, int min_len);
\ No newline at end of file
+int disasm_until(void* src, int min_len);
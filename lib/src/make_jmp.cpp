@@ -2,14 +2,14 @@
 
 #define ABS(x) ((x) >= 0 ? (x) : -(x))
 
-void make_jmp32(intptr_t src_addr, intptr_t dst_addr) {
-    auto jmp = (JumpInsn *) src_addr;
+void make_jmp32(void *buffer, intptr_t src_addr, intptr_t dst_addr) {
+    auto jmp = (JumpInsn *) buffer;
     jmp->opcode = JMP_OPCODE;
     jmp->offset = (int32_t) (dst_addr - (src_addr + sizeof(*jmp)));
 }
 
-void make_jmp64(uintptr_t src, uintptr_t dst) {
-    auto jmp = (Jmp64Insn *) src;
+void make_jmp64(void *buffer, uintptr_t dst) {
+    auto jmp = (Jmp64Insn *) buffer;
     jmp->push_opcode = PUSH_OPCODE;
     jmp->push_addr = (uint32_t) dst; /* truncate */
     jmp->mov_opcode = MOV_OPCODE;
@@ -20,10 +20,14 @@ void make_jmp64(uintptr_t src, uintptr_t dst) {
     jmp->ret_opcode = RET_OPCODE;
 }
 
-void make_jmp(void *src, void *dst) {
+void make_jmp(void *buffer, void *src, void *dst) {
     auto src_addr = (intptr_t) src;
     auto dst_addr = (intptr_t) dst;
     int64_t distance = std::abs(src_addr - dst_addr);
-    return (distance < INT32_MIN || distance > INT32_MAX) ? make_jmp64(src_addr, dst_addr) : make_jmp32(src_addr,
-                                                                                                        dst_addr);
+    return (distance < INT32_MIN || distance > INT32_MAX) ? make_jmp64(buffer, dst_addr) : make_jmp32(buffer, src_addr,
+                                                                                                      dst_addr);
+}
+
+void make_jmp(void *src, void *dst) {
+    make_jmp(src, src, dst);
 }
\ No newline at end of file
@@ -39,6 +39,10 @@ struct Jmp64Insn {
 /// Write valid x86 jump code to the given target address
 void make_jmp(void *src, void *dst);
 
+/// Write valid x86 jump code for the address `src` into `buffer`. Used if `src` is not writable from here,
+/// for example because it belongs to another process. The buffer must hold at least get_jmp_size(src, dst) bytes.
+void make_jmp(void *buffer, void *src, void *dst);
+
 inline size_t get_jmp_size(void *src, void *dst) {
     auto src_addr = (intptr_t) src;
     auto dst_addr = (intptr_t) dst;
@@ -60,7 +64,7 @@ inline void* read_jmp_destination(void *src) {
                && maybe_jmp64->mov_sib == JMP64_MOV_SIB
                && maybe_jmp64->mov_offset == JMP64_MOV_OFFSET
                && maybe_jmp64->ret_opcode == RET_OPCODE) {
-        return (void *) (maybe_jmp64->push_addr & ((uintptr_t) maybe_jmp64->mov_addr << 32));
+        return (void *) (maybe_jmp64->push_addr | ((uintptr_t) maybe_jmp64->mov_addr << 32));
     }
     return nullptr;
 }
\ No newline at end of file
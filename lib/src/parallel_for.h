@@ -0,0 +1,35 @@
+///! A minimal bounded worker pool for independent work items.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/// Returns the number of workers to use if the caller did not request a specific number.
+inline unsigned default_worker_count() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/// Calls fn(i) for every i in [0, count). Up to `workers` threads are used, the calling thread being one of them.
+/// Items are handed out one by one, so that a few expensive items do not stall a whole thread's share.
+/// Returns after all items have been processed.
+template<class F>
+void parallel_for(size_t count, unsigned workers, F &&fn) {
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+
+    size_t thread_count = std::min<size_t>(std::max(1u, workers), count);
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < thread_count; ++t) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto &thread: threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,189 @@
+#include "patch_bundle.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+/// Process wide, like the objects loaded by dlopen: The open memfds of all bundles by path, and the paths of the
+/// objects that have been loaded, with their dlopen handles.
+static std::mutex materialised_mutex;
+static std::map<string, int> open_memfds;
+static std::map<string, void *> loaded_objects;
+
+static string memfd_path(int memfd) {
+    return "/proc/self/fd/" + std::to_string(memfd);
+}
+
+PatchBundle::~PatchBundle() {
+    // Objects that have not been loaded are dropped with the bundle
+    {
+        std::lock_guard<std::mutex> lock(materialised_mutex);
+        for (auto &member: materialised) {
+            auto memfd = open_memfds.find(member.second);
+            if (memfd != open_memfds.end()) {
+                close(memfd->second);
+                open_memfds.erase(memfd);
+            }
+        }
+    }
+    if (data) {
+        munmap((void *) data, data_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+auto PatchBundle::open(const string &bundle_file) -> Result<bool> {
+    fd = ::open(bundle_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Result<bool>(std::in_place_index<1>, "File not found");
+    }
+    struct stat st{};
+    if (fstat(fd, &st) || size_t(st.st_size) < sizeof(BundleHeader)) {
+        return Result<bool>(std::in_place_index<1>, "Not a patch bundle");
+    }
+    auto mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return Result<bool>(std::in_place_index<1>, "mmap failed");
+    }
+    data = static_cast<const uint8_t *>(mapping);
+    data_size = st.st_size;
+
+    auto header = (const BundleHeader *) data;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0) {
+        return Result<bool>(std::in_place_index<1>, "Not a patch bundle");
+    }
+    if (header->version != BUNDLE_FORMAT_VERSION) {
+        return Result<bool>(std::in_place_index<1>, "Unsupported patch bundle version");
+    }
+
+    size_t pos = sizeof(BundleHeader);
+    for (uint32_t i = 0; i < header->entry_count; ++i) {
+        if (pos + sizeof(BundleEntry) > data_size) {
+            return Result<bool>(std::in_place_index<1>, "Truncated patch bundle");
+        }
+        auto entry = (const BundleEntry *) (data + pos);
+        pos += sizeof(BundleEntry);
+        if (pos + entry->name_size > data_size || entry->offset > data_size
+            || entry->size > data_size - entry->offset) {
+            return Result<bool>(std::in_place_index<1>, "Truncated patch bundle");
+        }
+        members.emplace(string((const char *) data + pos, entry->name_size),
+                        std::make_pair(entry->offset, entry->size));
+        pos += entry->name_size;
+    }
+    return Result<bool>(true);
+}
+
+auto PatchBundle::member(std::string_view name) const -> std::optional<std::string_view> {
+    auto it = members.find(name);
+    if (it == members.end()) {
+        return std::nullopt;
+    }
+    return std::string_view((const char *) data + it->second.first, it->second.second);
+}
+
+auto PatchBundle::materialise(std::string_view name) -> Result<string> {
+    auto it = materialised.find(name);
+    if (it == materialised.end()) {
+        auto object = member(name);
+        if (!object) {
+            return Result<string>(std::in_place_index<1>, "Bundle member not found");
+        }
+
+        int memfd = memfd_create(string(name).c_str(), MFD_CLOEXEC);
+        if (memfd < 0) {
+            return Result<string>(std::in_place_index<1>, "memfd_create failed");
+        }
+        // The data is copied straight out of the page cache backed mapping
+        for (size_t written = 0; written < object->size();) {
+            auto r = write(memfd, object->data() + written, object->size() - written);
+            if (r <= 0) {
+                close(memfd);
+                return Result<string>(std::in_place_index<1>, "Writing to memfd failed");
+            }
+            written += r;
+        }
+
+        // dlopen identifies already loaded libraries by their path, and libraries are never unloaded. The fd number
+        // of a loaded and closed memfd is reused by the kernel, so the memfd moves on to a number never loaded.
+        std::lock_guard<std::mutex> lock(materialised_mutex);
+        while (loaded_objects.count(memfd_path(memfd))) {
+            int moved = fcntl(memfd, F_DUPFD_CLOEXEC, memfd + 1);
+            close(memfd);
+            if (moved < 0) {
+                return Result<string>(std::in_place_index<1>, "Moving the memfd failed");
+            }
+            memfd = moved;
+        }
+        open_memfds.emplace(memfd_path(memfd), memfd);
+        it = materialised.emplace(string(name), memfd_path(memfd)).first;
+    }
+    return Result<string>(std::in_place_index<0>, it->second);
+}
+
+void release_materialised(const string &path, void *handle) {
+    std::lock_guard<std::mutex> lock(materialised_mutex);
+    auto memfd = open_memfds.find(path);
+    if (memfd == open_memfds.end()) {
+        return;
+    }
+    close(memfd->second);
+    open_memfds.erase(memfd);
+    loaded_objects.emplace(path, handle);
+}
+
+auto write_patch_bundle(const string &bundle_file, const string &registry_file,
+                        const std::vector<string> &patch_files) -> Result<bool> {
+    // Member names and their contents. The registry always comes first.
+    std::vector<std::pair<string, string>> contents;
+    auto add_member = [&](const string &name, const string &file) {
+        std::ifstream i(file, std::ios::binary);
+        if (!i) {
+            return false;
+        }
+        std::ostringstream ss;
+        ss << i.rdbuf();
+        contents.emplace_back(name, ss.str());
+        return true;
+    };
+    if (!add_member(BUNDLE_REGISTRY_NAME, registry_file)) {
+        return Result<bool>(std::in_place_index<1>, "File not found");
+    }
+    for (auto &patch_file: patch_files) {
+        if (!add_member(patch_file, patch_file)) {
+            return Result<bool>(std::in_place_index<1>, "File not found");
+        }
+    }
+
+    uint64_t offset = sizeof(BundleHeader);
+    for (auto &member: contents) {
+        offset += sizeof(BundleEntry) + member.first.size();
+    }
+
+    std::ofstream o(bundle_file, std::ios::binary | std::ios::trunc);
+    if (!o) {
+        return Result<bool>(std::in_place_index<1>, "Failed to create bundle file");
+    }
+    BundleHeader header{};
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_FORMAT_VERSION;
+    header.entry_count = contents.size();
+    o.write((const char *) &header, sizeof(header));
+    for (auto &member: contents) {
+        BundleEntry entry{offset, member.second.size(), (uint32_t) member.first.size()};
+        o.write((const char *) &entry, sizeof(entry));
+        o.write(member.first.data(), member.first.size());
+        offset += member.second.size();
+    }
+    for (auto &member: contents) {
+        o.write(member.second.data(), member.second.size());
+    }
+    return o ? Result<bool>(true) : Result<bool>(std::in_place_index<1>, "Failed to write bundle file");
+}
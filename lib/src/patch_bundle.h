@@ -0,0 +1,70 @@
+///! A patch bundle is a single file that contains the registry meta data and all patch objects.
+#pragma once
+
+#include "runtime_patching_lib.h"
+
+#include <cstdint>
+#include <map>
+
+#define BUNDLE_MAGIC "RPBUNDLE"
+#define BUNDLE_FORMAT_VERSION 1
+/// The member name of the registry meta data within a bundle
+#define BUNDLE_REGISTRY_NAME "meta.json"
+
+/* Layout: A BundleHeader, followed by entry_count BundleEntry structs. Each BundleEntry is directly followed by
+ * name_size bytes of the member name. Offsets of the member data are relative to the start of the file.
+ * All numbers are in host byte order.
+ */
+#pragma pack(push, 1)
+struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+};
+
+struct BundleEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t name_size;
+};
+#pragma pack(pop)
+
+/// A memory mapped bundle file. Patch objects are materialised into anonymous memory files (memfd),
+/// that can be given to `dlopen` via their /proc/self/fd path. Nothing is extracted to disk.
+///
+/// glibc's `dlopen` only loads whole files, it cannot load an object from an offset within the bundle. So each patch
+/// object is copied once from the bundle mapping into its memfd, and `dlopen` maps the pages of the memfd directly.
+/// Other processes share those pages via a patch daemon, see ::run_patch_daemon.
+///
+/// A memfd is closed once its object has been loaded, see ::release_materialised, or when the bundle is destroyed.
+/// The paths of loaded objects are never handed out again, as `dlopen` identifies loaded objects by their path.
+class PatchBundle {
+private:
+    int fd = -1;
+    const uint8_t *data = nullptr;
+    size_t data_size = 0;
+    /// Member name to (offset, size)
+    std::map<string, std::pair<uint64_t, uint64_t>, std::less<>> members;
+    /// Already materialised members: Member name to /proc/self/fd path
+    std::map<string, string, std::less<>> materialised;
+
+public:
+    PatchBundle() = default;
+    PatchBundle(const PatchBundle &) = delete;
+    PatchBundle &operator=(const PatchBundle &) = delete;
+    ~PatchBundle();
+
+    /// Maps the given bundle file and reads the member table.
+    auto open(const string &bundle_file) -> Result<bool>;
+
+    /// Returns the content of a member. The view is valid for the lifetime of this object.
+    auto member(std::string_view name) const -> std::optional<std::string_view>;
+
+    /// Copies the given member into a memfd and returns a path that can be used with `dlopen`.
+    /// Repeated calls for the same member return the same path.
+    auto materialise(std::string_view name) -> Result<string>;
+};
+
+/// Tells that the object at `path` has been loaded by `dlopen` as `handle`. If it is a materialised patch object,
+/// its memfd is closed, as the loader keeps the object mapped. Its path is never handed out again.
+void release_materialised(const string &path, void *handle);
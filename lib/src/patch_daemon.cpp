@@ -0,0 +1,314 @@
+#include "patch_daemon.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <filesystem>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+/// How long a client waits for the initial index after connecting
+#define DAEMON_INDEX_TIMEOUT_MS 1000
+
+auto write_shared_index(const std::vector<Patch> &entries) -> Result<int> {
+    string strings;
+    std::vector<SharedIndexEntry> index_entries;
+    auto add_string = [&](const string &str, uint32_t &offset, uint32_t &size) {
+        offset = strings.size();
+        size = str.size();
+        strings += str;
+    };
+    for (auto &patch: entries) {
+        SharedIndexEntry e{};
+        e.generation = patch.generation;
+        e.new_version = patch.new_version;
+        add_string(patch.about, e.about_offset, e.about_size);
+        add_string(patch.symbol_name, e.symbol_name_offset, e.symbol_name_size);
+        add_string(patch.patch_file, e.patch_file_offset, e.patch_file_size);
+        index_entries.push_back(e);
+    }
+
+    SharedIndexHeader header{};
+    memcpy(header.magic, SHARED_INDEX_MAGIC, sizeof(header.magic));
+    header.entry_count = index_entries.size();
+    header.strings_size = strings.size();
+    header.generation = entries.empty() ? 0 : entries.back().generation;
+
+    int fd = memfd_create("runtime_patching_index", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return Result<int>(std::in_place_index<1>, "memfd_create failed");
+    }
+    std::pair<const void *, size_t> parts[] = {
+            {&header,               sizeof(header)},
+            {index_entries.data(), index_entries.size() * sizeof(SharedIndexEntry)},
+            {strings.data(),       strings.size()},
+    };
+    for (auto &part: parts) {
+        for (size_t written = 0; written < part.second;) {
+            auto r = write(fd, (const uint8_t *) part.first + written, part.second - written);
+            if (r <= 0) {
+                close(fd);
+                return Result<int>(std::in_place_index<1>, "Writing to memfd failed");
+            }
+            written += r;
+        }
+    }
+    // Clients can rely on the index never changing underneath them
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        close(fd);
+        return Result<int>(std::in_place_index<1>, "Sealing the index failed");
+    }
+    return Result<int>(std::in_place_index<0>, fd);
+}
+
+/// Sends a file descriptor over a unix domain socket. The payload is the index generation.
+/// Returns false on errors, including a full socket buffer of a non blocking socket.
+static bool send_fd(int socket_fd, int fd, uint64_t generation) {
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec iov{&generation, sizeof(generation)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(socket_fd, &msg, MSG_NOSIGNAL) == sizeof(generation);
+}
+
+/// Receives a file descriptor sent by #send_fd. Returns -1 if nothing is pending (non blocking mode) or on errors,
+/// -2 if the peer has closed the connection.
+static int receive_fd(int socket_fd, int flags) {
+    uint64_t generation;
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    iovec iov{&generation, sizeof(generation)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto r = recvmsg(socket_fd, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (r == 0) {
+        return -2;
+    }
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (r < 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+static auto make_socket_address(const string &socket_path) -> std::optional<sockaddr_un> {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        return std::nullopt;
+    }
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    return addr;
+}
+
+PatchDaemonClient::~PatchDaemonClient() {
+    if (socket_fd >= 0) {
+        close(socket_fd);
+    }
+}
+
+auto PatchDaemonClient::connect() -> Result<bool> {
+    auto addr = make_socket_address(socket_path);
+    if (!addr) {
+        return Result<bool>(std::in_place_index<1>, "Socket path too long");
+    }
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0 || ::connect(socket_fd, (const sockaddr *) &*addr, sizeof(*addr))) {
+        if (socket_fd >= 0) {
+            close(socket_fd);
+            socket_fd = -1;
+        }
+        return Result<bool>(std::in_place_index<1>, "Failed to connect to the patch daemon");
+    }
+    // A restarted daemon numbers its entries from 1 again. Entries that are already known are dropped by the registry.
+    consumed_generation = 0;
+    return Result<bool>(true);
+}
+
+auto PatchDaemonClient::poll(const std::function<void(Patch &&)> &fn) -> Result<bool> {
+    if (socket_fd < 0) {
+        auto connected = connect();
+        if (connected.index() != 0) {
+            return connected;
+        }
+        // The daemon sends its current index right after accepting the connection. A stalled daemon must not hang
+        // the caller. The index is picked up by a later call then.
+        pollfd pending{socket_fd, POLLIN, 0};
+        if (::poll(&pending, 1, DAEMON_INDEX_TIMEOUT_MS) != 1) {
+            return Result<bool>(std::in_place_index<1>, "The patch daemon did not send its index in time");
+        }
+    }
+
+    // Only the newest of all pending indices is of interest
+    int index_fd = -1;
+    for (int fd = receive_fd(socket_fd, MSG_DONTWAIT); fd != -1; fd = receive_fd(socket_fd, MSG_DONTWAIT)) {
+        if (fd == -2) {
+            std::cerr << "The patch daemon closed the connection\n";
+            close(socket_fd);
+            socket_fd = -1;
+            break;
+        }
+        if (index_fd >= 0) {
+            close(index_fd);
+        }
+        index_fd = fd;
+    }
+    if (index_fd < 0) {
+        return Result<bool>(true);
+    }
+
+    struct stat st{};
+    void *data = MAP_FAILED;
+    if (!fstat(index_fd, &st)) {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+    }
+    close(index_fd);
+    if (data == MAP_FAILED) {
+        return Result<bool>(std::in_place_index<1>, "Failed to map the patch daemon index");
+    }
+
+    auto valid = read_shared_index((const uint8_t *) data, st.st_size, consumed_generation, [&](Patch &&patch) {
+        consumed_generation = patch.generation;
+        fn(std::move(patch));
+    });
+    munmap(data, st.st_size);
+    if (!valid) {
+        return Result<bool>(std::in_place_index<1>, "Invalid patch daemon index");
+    }
+    return Result<bool>(true);
+}
+
+string shared_patch_path(const string &patch_file) {
+    // In-memory files of patch bundles are reachable via the daemons /proc entry
+    const string self_fd = "/proc/self/fd/";
+    if (patch_file.rfind(self_fd, 0) == 0) {
+        return "/proc/" + std::to_string(getpid()) + "/fd/" + patch_file.substr(self_fd.size());
+    }
+    return (fs::current_path() / patch_file).string();
+}
+
+auto run_patch_daemon(const string &registry_uri, const string &socket_path,
+                      const std::atomic<bool> &stop) -> Result<bool> {
+    auto addr = make_socket_address(socket_path);
+    if (!addr) {
+        return Result<bool>(std::in_place_index<1>, "Socket path too long");
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (const sockaddr *) &*addr, sizeof(*addr)) || listen(listen_fd, 64)) {
+        perror("Failed to create the patch daemon socket");
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return Result<bool>(std::in_place_index<1>, "Failed to create the patch daemon socket");
+    }
+
+    PatchRegistry registry(registry_uri);
+    std::vector<Patch> shared_entries;
+    int index_fd = -1;
+    uint64_t index_generation = 0;
+    fs::file_time_type registry_mtime;
+    std::vector<int> clients;
+
+    // Re-reads the registry and publishes a new index if it has new entries
+    auto refresh = [&]() {
+        std::error_code ec;
+        auto mtime = fs::last_write_time(fs::current_path() / registry_uri, ec);
+        if (ec || (index_fd >= 0 && mtime == registry_mtime)) {
+            return;
+        }
+        registry_mtime = mtime;
+        registry.expire_cache();
+        auto result = registry.get_patch_directory_since(index_generation);
+        auto new_entries = std::get_if<PatchRange>(&result);
+        if (!new_entries || (index_fd >= 0 && new_entries->size() == 0)) {
+            return;
+        }
+        for (auto &patch: *new_entries) {
+            shared_entries.push_back(patch);
+            shared_entries.back().patch_file = shared_patch_path(patch.patch_file);
+        }
+        auto index = write_shared_index(shared_entries);
+        if (auto error = std::get_if<std::string_view>(&index)) {
+            std::cerr << "Failed to publish the registry index: " << *error << "\n";
+            return;
+        }
+        if (index_fd >= 0) {
+            close(index_fd);
+        }
+        index_fd = std::get<int>(index);
+        index_generation = registry.current_generation();
+        std::clog << "Publishing registry generation " << index_generation << " to " << clients.size()
+                  << " clients\n";
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (send_fd(*it, index_fd, index_generation)) {
+                ++it;
+            } else {
+                close(*it);
+                it = clients.erase(it);
+            }
+        }
+    };
+
+    refresh();
+    while (!stop) {
+        std::vector<pollfd> fds{{listen_fd, POLLIN, 0}};
+        for (int client: clients) {
+            fds.push_back({client, POLLIN, 0});
+        }
+        // The timeout bounds how long a registry change or a stop request goes unnoticed
+        if (::poll(fds.data(), fds.size(), 500) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        // Clients never send anything. Readable means disconnected.
+        for (size_t i = fds.size() - 1; i > 0; --i) {
+            if (fds[i].revents) {
+                close(fds[i].fd);
+                clients.erase(clients.begin() + (i - 1));
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            // Non blocking, so that a client that stops reading cannot stall the daemon for all other clients.
+            // Once its socket buffer is full, send_fd fails with EAGAIN and the client is dropped. It reconnects
+            // on its next poll and gets the current index.
+            int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client >= 0) {
+                if (index_fd >= 0 && send_fd(client, index_fd, index_generation)) {
+                    clients.push_back(client);
+                } else {
+                    close(client);
+                }
+            }
+        }
+        refresh();
+    }
+
+    for (int client: clients) {
+        close(client);
+    }
+    if (index_fd >= 0) {
+        close(index_fd);
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    return Result<bool>(true);
+}
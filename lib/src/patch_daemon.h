@@ -0,0 +1,108 @@
+///! A host wide patch daemon. The daemon parses the registry once and publishes it as a read-only, shared memory index.
+///! Clients receive the index file descriptor over a unix domain socket and never parse json themselves.
+#pragma once
+
+#include "runtime_patching_lib.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#define SHARED_INDEX_MAGIC "RPINDEX1"
+
+/// The registry URI prefix that selects the daemon client mode of ::PatchRegistry
+#define DAEMON_URI_PREFIX "unix:"
+
+/* Layout: A SharedIndexHeader, followed by entry_count SharedIndexEntry structs, ordered by generation,
+ * followed by the string table. String offsets are relative to the start of the string table.
+ */
+#pragma pack(push, 1)
+struct SharedIndexHeader {
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t strings_size;
+    /// The generation of the newest entry
+    uint64_t generation;
+};
+
+struct SharedIndexEntry {
+    uint64_t generation;
+    int32_t new_version;
+    uint32_t about_offset, about_size;
+    uint32_t symbol_name_offset, symbol_name_size;
+    uint32_t patch_file_offset, patch_file_size;
+};
+#pragma pack(pop)
+
+/// Serializes the given registry entries into a sealed, read-only memfd and returns its file descriptor.
+/// Patch file paths must be valid in other processes (absolute paths or /proc/<pid>/fd paths).
+auto write_shared_index(const std::vector<Patch> &entries) -> Result<int>;
+
+/// Returns a path to the given patch file that is valid in other processes as well.
+/// In-memory files of this process (/proc/self/fd/N) are turned into /proc/<pid>/fd/N paths.
+string shared_patch_path(const string &patch_file);
+
+/// Calls fn(Patch&&) for every entry of a mapped shared index that is newer than the given generation.
+/// Returns false if the mapping is not a valid index.
+template<class F>
+bool read_shared_index(const uint8_t *data, size_t size, uint64_t since, F &&fn);
+
+/// The client side of the daemon connection. Owned by a ::PatchRegistry with a "unix:" registry URI.
+class PatchDaemonClient {
+private:
+    string socket_path;
+    int socket_fd = -1;
+    /// The newest daemon generation that has been handed out by #poll
+    uint64_t consumed_generation = 0;
+
+    auto connect() -> Result<bool>;
+
+public:
+    explicit PatchDaemonClient(string socket_path) noexcept : socket_path(std::move(socket_path)) {}
+    PatchDaemonClient(const PatchDaemonClient &) = delete;
+    PatchDaemonClient &operator=(const PatchDaemonClient &) = delete;
+    ~PatchDaemonClient();
+
+    /// Picks up the newest index the daemon has published, if any, and calls fn(Patch&&) for every entry
+    /// that has not been handed out before. Connects to the daemon first if required.
+    /// Blocks only after connecting, until the daemon has sent its initial index, for up to a second.
+    /// Reconnects after the daemon has closed the connection, and then hands out all entries of the new daemon.
+    auto poll(const std::function<void(Patch &&)> &fn) -> Result<bool>;
+};
+
+template<class F>
+bool read_shared_index(const uint8_t *data, size_t size, uint64_t since, F &&fn) {
+    if (size < sizeof(SharedIndexHeader)) {
+        return false;
+    }
+    auto header = (const SharedIndexHeader *) data;
+    auto entries = (const SharedIndexEntry *) (data + sizeof(SharedIndexHeader));
+    auto strings = (const char *) (entries + header->entry_count);
+    if (memcmp(header->magic, SHARED_INDEX_MAGIC, sizeof(header->magic)) != 0
+        || sizeof(SharedIndexHeader) + header->entry_count * sizeof(SharedIndexEntry) + header->strings_size > size) {
+        return false;
+    }
+
+    auto str = [&](uint32_t offset, uint32_t length) {
+        if (uint64_t(offset) + length > header->strings_size) {
+            return string();
+        }
+        return string(strings + offset, length);
+    };
+    // Entries are ordered by generation
+    auto first = std::partition_point(entries, entries + header->entry_count, [since](const SharedIndexEntry &e) {
+        return e.generation <= since;
+    });
+    for (auto it = first; it != entries + header->entry_count; ++it) {
+        auto &e = *it;
+        fn(Patch{
+                .new_version = e.new_version,
+                .about = str(e.about_offset, e.about_size),
+                .symbol_name = str(e.symbol_name_offset, e.symbol_name_size),
+                .patch_file = str(e.patch_file_offset, e.patch_file_size),
+                .generation = e.generation,
+        });
+    }
+    return true;
+}
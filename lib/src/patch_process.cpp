@@ -0,0 +1,153 @@
+#include "runtime_patching_lib.h"
+#include "elf_symbols.h"
+#include "lde_minimal.h"
+#include "make_jmp.h"
+#include "patch_daemon.h"
+#include "remote_process.h"
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#define NOP_OPCODE  0x90
+
+/// Returns the address of a function of this process in the given process. Both processes need to have
+/// the same shared library loaded that contains the function.
+static uintptr_t remote_function_address(pid_t pid, void *local_function) {
+    Dl_info info{};
+    if (!dladdr(local_function, &info) || !info.dli_fname) {
+        return 0;
+    }
+    auto remote_base = find_mapping_base(pid, info.dli_fname);
+    if (!remote_base) {
+        return 0;
+    }
+    return remote_base + ((uintptr_t) local_function - (uintptr_t) info.dli_fbase);
+}
+
+/// Loads the patch object into the process and overwrites the target function prologue with a jump.
+/// Returns false if the prologue already jumps to the patch.
+static auto inject_patch(RemoteProcess &process, uintptr_t remote_dlopen, uintptr_t remote_dlsym,
+                         const Patch &patch, uintptr_t target) -> Result<bool> {
+    auto path = process.push_string(shared_patch_path(patch.patch_file));
+    if (path.index() != 0) {
+        return Result<bool>(std::in_place_index<1>, std::get<1>(path));
+    }
+    auto handle = process.call(remote_dlopen, {std::get<0>(path), RTLD_NOW});
+    if (handle.index() != 0 || !std::get<0>(handle)) {
+        return Result<bool>(std::in_place_index<1>, "Failed to load shared library in the target process");
+    }
+    auto symbol = process.push_string(patch.symbol_name);
+    if (symbol.index() != 0) {
+        return Result<bool>(std::in_place_index<1>, std::get<1>(symbol));
+    }
+    auto patched = process.call(remote_dlsym, {std::get<0>(handle), std::get<0>(symbol)});
+    if (patched.index() != 0 || !std::get<0>(patched)) {
+        return Result<bool>(std::in_place_index<1>, "dlsym failed in the target process");
+    }
+    auto patched_function = (void *) std::get<0>(patched);
+
+    // The prologue is analysed and rewritten in a local copy
+    uint8_t code[2 * MAX_INSN_LEN + sizeof(Jmp64Insn)];
+    auto read = process.read(target, code, sizeof(code));
+    if (read.index() != 0) {
+        return read;
+    }
+    size_t min_size = get_jmp_size((void *) target, patched_function);
+    uint8_t jump[sizeof(Jmp64Insn)];
+    make_jmp(jump, (void *) target, patched_function);
+    if (!memcmp(code, jump, min_size)) {
+        return Result<bool>(false);
+    }
+    size_t actual_size = disasm_until(code, min_size);
+    if (!actual_size) {
+        return Result<bool>(std::in_place_index<1>, "disasm_until failed");
+    }
+    if (process.is_executing(target, actual_size)) {
+        return Result<bool>(std::in_place_index<1>, "A thread is executing the target function prologue");
+    }
+    memcpy(code, jump, min_size);
+    for (size_t addr = min_size; addr < actual_size; ++addr) {
+        code[addr] = NOP_OPCODE;
+    }
+    auto written = process.write(target, code, actual_size);
+    if (written.index() != 0) {
+        return written;
+    }
+    return Result<bool>(true);
+}
+
+auto patch_process(int pid, PatchRegistry &patch_registry) -> Result<int> {
+    auto cache_result = patch_registry.get_patch_directory();
+    auto cache = std::get_if<PatchRegistry::cache_pointer>(&cache_result);
+    if (!cache) {
+        return Result<int>(std::in_place_index<1>, "Failed to get registry cache pointer");
+    }
+
+    auto exe = "/proc/" + std::to_string(pid) + "/exe";
+    auto elf = read_elf_functions(exe);
+    if (auto error = std::get_if<std::string_view>(&elf)) {
+        return Result<int>(std::in_place_index<1>, *error);
+    }
+    auto &functions = std::get<ElfFunctions>(elf);
+    uintptr_t base = 0;
+    if (functions.position_independent && !(base = find_mapping_base(pid, exe))) {
+        return Result<int>(std::in_place_index<1>, "Executable mapping not found");
+    }
+
+    // The newest patch for every function of the executable
+    std::map<string, uintptr_t> targets;
+    for (auto &function: functions.functions) {
+        targets.emplace(function.name, base + function.address);
+    }
+    std::map<string, const Patch *> newest;
+    for (auto &cache_entry: **cache) {
+        if (!targets.count(cache_entry.symbol_name)) {
+            continue;
+        }
+        auto &entry = newest[cache_entry.symbol_name];
+        if (!entry || entry->new_version < cache_entry.new_version) {
+            entry = &cache_entry;
+        }
+    }
+    if (newest.empty()) {
+        return Result<int>(std::in_place_index<0>, 0);
+    }
+
+    auto remote_dlopen = remote_function_address(pid, (void *) &dlopen);
+    auto remote_dlsym = remote_function_address(pid, (void *) &dlsym);
+    if (!remote_dlopen || !remote_dlsym) {
+        return Result<int>(std::in_place_index<1>, "dlopen not found in the target process");
+    }
+
+    RemoteProcess process(pid);
+    auto start = std::chrono::steady_clock::now();
+    auto attached = process.attach();
+    if (auto error = std::get_if<std::string_view>(&attached)) {
+        return Result<int>(std::in_place_index<1>, *error);
+    }
+    int patched = 0;
+    for (auto &entry: newest) {
+        auto &patch = *entry.second;
+        auto result = inject_patch(process, remote_dlopen, remote_dlsym, patch, targets[patch.symbol_name]);
+        if (auto error = std::get_if<std::string_view>(&result)) {
+            std::cerr << "Failed to patch " << patch.symbol_name << ": " << *error << "\n";
+            // A timed out call has detached the process, which may now be stuck in the loader
+            if (!process.is_attached()) {
+                return Result<int>(std::in_place_index<1>, *error);
+            }
+            continue;
+        }
+        if (!std::get<bool>(result)) {
+            continue;
+        }
+        std::clog << "Patched " << patch.symbol_name << " to " << patch.new_version << "\n";
+        ++patched;
+    }
+    process.detach();
+    std::chrono::duration<double, std::milli> stopped = std::chrono::steady_clock::now() - start;
+    std::clog << "Process " << pid << " was stopped for " << stopped.count() << " ms\n";
+    return Result<int>(std::in_place_index<0>, patched);
+}
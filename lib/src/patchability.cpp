@@ -0,0 +1,267 @@
+#include "patchability.h"
+#include "elf_symbols.h"
+#include "lde_minimal.h"
+#include "make_jmp.h"
+#include "parallel_for.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+/// Change the version whenever the analysis (or the length disassembler) changes, to invalidate existing caches
+#define PATCHABILITY_CACHE_MAGIC "RPPMAP02"
+
+static_assert(JMP32_SIZE == sizeof(JumpInsn) && JMP64_SIZE == sizeof(Jmp64Insn));
+
+/* Cache file layout: A PatchabilityCacheHeader, followed by entry_count PatchabilityCacheEntry structs,
+ * followed by the string table with all symbol names.
+ */
+#pragma pack(push, 1)
+struct PatchabilityCacheHeader {
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t strings_size;
+};
+
+struct PatchabilityCacheEntry {
+    uint64_t address;
+    uint64_t size;
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint8_t decoded;
+    uint8_t jmp32_overwrite;
+    uint8_t jmp64_overwrite;
+    uint8_t reloc_count;
+    uint8_t reloc_offsets[MAX_PROLOGUE_RELOCS];
+};
+#pragma pack(pop)
+
+const FunctionPatchability *PatchabilityMap::find(const void *address) const {
+    auto relative = (uint64_t) ((uintptr_t) address - load_base);
+    auto it = std::lower_bound(functions.begin(), functions.end(), relative,
+                               [](const FunctionPatchability &f, uint64_t a) { return f.address < a; });
+    if (it == functions.end() || it->address != relative) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+void analyse_prologue(const uint8_t *code, FunctionPatchability &f) {
+    size_t offset = 0;
+    while (offset < sizeof(Jmp64Insn)) {
+        int insn_len, reloc_op_offset;
+        std::tie(insn_len, reloc_op_offset) = disasm((void *) (code + offset));
+        if (insn_len == 0) {
+            break;
+        }
+        if (reloc_op_offset && f.reloc_count < MAX_PROLOGUE_RELOCS) {
+            f.reloc_offsets[f.reloc_count++] = offset + reloc_op_offset;
+        }
+        offset += insn_len;
+        if (!f.jmp32_overwrite && offset >= sizeof(JumpInsn)) {
+            f.jmp32_overwrite = offset;
+        }
+    }
+    f.decoded = std::min(offset, sizeof(Jmp64Insn));
+    if (offset >= sizeof(Jmp64Insn)) {
+        f.jmp64_overwrite = offset;
+    }
+
+    // Jumps must not overwrite the following function. A size of 0 means unknown.
+    if (f.size && f.jmp32_overwrite > f.size) {
+        f.jmp32_overwrite = 0;
+    }
+    if (f.size && f.jmp64_overwrite > f.size) {
+        f.jmp64_overwrite = 0;
+    }
+}
+
+static auto analyse(const string &elf_file, const ElfFunctions &elf, unsigned workers) -> Result<PatchabilityMap> {
+    int fd = open(elf_file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    void *mapping = MAP_FAILED;
+    if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0) {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (mapping == MAP_FAILED) {
+        return Result<PatchabilityMap>(std::in_place_index<1>, "File not found");
+    }
+    auto data = (const uint8_t *) mapping;
+    size_t size = st.st_size;
+
+    // Aliases share an address. Each name gets an entry, but the prologue is analysed once.
+    auto functions = elf.functions;
+    functions.erase(std::remove_if(functions.begin(), functions.end(),
+                                   [](const ElfFunction &f) { return !f.file_offset; }), functions.end());
+    std::sort(functions.begin(), functions.end(), [](auto &a, auto &b) {
+        return a.address < b.address || (a.address == b.address && a.name < b.name);
+    });
+
+    PatchabilityMap map;
+    map.build_id = elf.build_id;
+    std::vector<uint64_t> offsets;
+    for (auto &function: functions) {
+        map.functions.push_back(FunctionPatchability{
+                .symbol_name = function.name, .address = function.address, .size = function.size});
+        offsets.push_back(function.file_offset);
+    }
+
+    parallel_for(map.functions.size(), workers, [&](size_t i) {
+        if (i && map.functions[i - 1].address == map.functions[i].address) {
+            return;
+        }
+        // A zero padded copy, so that the disassembler never reads past the end of the file
+        uint8_t code[sizeof(Jmp64Insn) + 2 * MAX_INSN_LEN] = {};
+        if (offsets[i] < size) {
+            memcpy(code, data + offsets[i], std::min<size_t>(sizeof(code), size - offsets[i]));
+        }
+        analyse_prologue(code, map.functions[i]);
+    });
+    for (size_t i = 1; i < map.functions.size(); ++i) {
+        auto &alias = map.functions[i];
+        auto &first = map.functions[i - 1];
+        if (alias.address == first.address) {
+            alias = first;
+            alias.symbol_name = functions[i].name;
+        }
+    }
+    munmap(mapping, size);
+    return Result<PatchabilityMap>(std::in_place_index<0>, std::move(map));
+}
+
+static fs::path cache_file(const string &build_id) {
+    fs::path dir;
+    if (auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        dir = xdg;
+    } else if (auto home = getenv("HOME"); home && *home) {
+        dir = fs::path(home) / ".cache";
+    } else {
+        return {};
+    }
+    return dir / "runtime_patching" / (build_id + ".map");
+}
+
+static bool read_cache(const fs::path &file, PatchabilityMap &map) {
+    std::ifstream i(file, std::ios::binary);
+    if (!i) {
+        return false;
+    }
+    std::ostringstream ss;
+    ss << i.rdbuf();
+    auto content = ss.str();
+
+    auto header = (const PatchabilityCacheHeader *) content.data();
+    if (content.size() < sizeof(PatchabilityCacheHeader)
+        || memcmp(header->magic, PATCHABILITY_CACHE_MAGIC, sizeof(header->magic)) != 0
+        || sizeof(PatchabilityCacheHeader) + uint64_t(header->entry_count) * sizeof(PatchabilityCacheEntry)
+           + header->strings_size != content.size()) {
+        return false;
+    }
+    auto entries = (const PatchabilityCacheEntry *) (content.data() + sizeof(PatchabilityCacheHeader));
+    auto strings = (const char *) (entries + header->entry_count);
+    for (uint32_t n = 0; n < header->entry_count; ++n) {
+        auto &e = entries[n];
+        if (uint64_t(e.name_offset) + e.name_size > header->strings_size || e.reloc_count > MAX_PROLOGUE_RELOCS) {
+            return false;
+        }
+        FunctionPatchability f{
+                .symbol_name = string(strings + e.name_offset, e.name_size),
+                .address = e.address,
+                .size = e.size,
+                .decoded = e.decoded,
+                .jmp32_overwrite = e.jmp32_overwrite,
+                .jmp64_overwrite = e.jmp64_overwrite,
+                .reloc_count = e.reloc_count,
+        };
+        memcpy(f.reloc_offsets, e.reloc_offsets, sizeof(f.reloc_offsets));
+        map.functions.push_back(std::move(f));
+    }
+    return true;
+}
+
+static void write_cache(const fs::path &file, const PatchabilityMap &map) {
+    string strings;
+    std::vector<PatchabilityCacheEntry> entries;
+    for (auto &f: map.functions) {
+        PatchabilityCacheEntry e{};
+        e.address = f.address;
+        e.size = f.size;
+        e.name_offset = strings.size();
+        e.name_size = f.symbol_name.size();
+        e.decoded = f.decoded;
+        e.jmp32_overwrite = f.jmp32_overwrite;
+        e.jmp64_overwrite = f.jmp64_overwrite;
+        e.reloc_count = f.reloc_count;
+        memcpy(e.reloc_offsets, f.reloc_offsets, sizeof(e.reloc_offsets));
+        strings += f.symbol_name;
+        entries.push_back(e);
+    }
+    PatchabilityCacheHeader header{};
+    memcpy(header.magic, PATCHABILITY_CACHE_MAGIC, sizeof(header.magic));
+    header.entry_count = entries.size();
+    header.strings_size = strings.size();
+
+    // Written to a temporary file first, so that concurrently starting processes never read a partial cache
+    std::error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+    auto tmp_file = file;
+    tmp_file += "." + std::to_string(getpid());
+    {
+        std::ofstream o(tmp_file, std::ios::binary | std::ios::trunc);
+        o.write((const char *) &header, sizeof(header));
+        o.write((const char *) entries.data(), entries.size() * sizeof(PatchabilityCacheEntry));
+        o.write(strings.data(), strings.size());
+        if (!o) {
+            fs::remove(tmp_file, ec);
+            return;
+        }
+    }
+    fs::rename(tmp_file, file, ec);
+}
+
+auto load_patchability_map(const string &elf_file,
+                           unsigned workers) -> Result<std::shared_ptr<const PatchabilityMap>> {
+    using MapResult = Result<std::shared_ptr<const PatchabilityMap>>;
+    // Only the ELF header and notes are read, as long as the map is cached
+    auto elf = read_elf_functions(elf_file, false);
+    if (auto error = std::get_if<std::string_view>(&elf)) {
+        return MapResult(std::in_place_index<1>, *error);
+    }
+    auto &functions = std::get<ElfFunctions>(elf);
+
+    auto map = std::make_shared<PatchabilityMap>();
+    map->build_id = functions.build_id;
+    auto cache = functions.build_id.empty() ? fs::path() : cache_file(functions.build_id);
+    if (!cache.empty() && read_cache(cache, *map)) {
+        map->from_cache = true;
+    } else {
+        elf = read_elf_functions(elf_file);
+        if (auto error = std::get_if<std::string_view>(&elf)) {
+            return MapResult(std::in_place_index<1>, *error);
+        }
+        auto analysed = analyse(elf_file, functions, workers ? workers : default_worker_count());
+        if (auto error = std::get_if<std::string_view>(&analysed)) {
+            return MapResult(std::in_place_index<1>, *error);
+        }
+        *map = std::move(std::get<PatchabilityMap>(analysed));
+        if (!cache.empty()) {
+            write_cache(cache, *map);
+        }
+    }
+
+    if (functions.position_independent) {
+        map->load_base = find_mapping_base(getpid(), elf_file);
+    }
+    return MapResult(std::in_place_index<0>, std::move(map));
+}
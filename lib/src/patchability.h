@@ -0,0 +1,10 @@
+///! Prologue analysis for ::FunctionPatchability entries.
+#pragma once
+
+#include "runtime_patching_lib.h"
+
+#include <cstdint>
+
+/// Disassembles a function prologue to fill the overwrite lengths and relocation offsets of the given entry.
+/// The function size must already be set. `code` must contain at least JMP64_SIZE + MAX_INSN_LEN readable bytes.
+void analyse_prologue(const uint8_t *code, FunctionPatchability &f);
@@ -0,0 +1,215 @@
+#include "remote_process.h"
+
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+/// Injected calls use the stack this far below the red zone
+#define REMOTE_STACK_GAP 256
+/// An injected call that does not return within this time is abandoned
+#define REMOTE_CALL_TIMEOUT_MS 5000
+
+RemoteProcess::~RemoteProcess() {
+    detach();
+}
+
+auto RemoteProcess::attach() -> Result<bool> {
+    // Threads might be created while attaching. Repeat until no new thread shows up.
+    bool found_new = true;
+    while (found_new) {
+        found_new = false;
+        std::error_code ec;
+        for (auto &task: fs::directory_iterator("/proc/" + std::to_string(pid) + "/task", ec)) {
+            pid_t tid = std::stoi(task.path().filename().string());
+            if (std::find(threads.begin(), threads.end(), tid) != threads.end()) {
+                continue;
+            }
+            if (ptrace(PTRACE_SEIZE, tid, nullptr, nullptr) || ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr)) {
+                // The thread might have exited in the meantime
+                continue;
+            }
+            int status;
+            if (waitpid(tid, &status, __WALL) != tid || !WIFSTOPPED(status)) {
+                continue;
+            }
+            threads.push_back(tid);
+            found_new = true;
+        }
+        if (ec) {
+            return Result<bool>(std::in_place_index<1>, "Process not found");
+        }
+    }
+    if (std::find(threads.begin(), threads.end(), pid) == threads.end()) {
+        detach();
+        return Result<bool>(std::in_place_index<1>, "ptrace attach failed. Check permissions and ptrace_scope");
+    }
+    return Result<bool>(true);
+}
+
+void RemoteProcess::detach() {
+    // Signals suppressed during injected calls are queued again, so that the process still receives them
+    if (!threads.empty()) {
+        for (auto signal: suppressed_signals) {
+            syscall(SYS_tgkill, pid, pid, signal);
+        }
+    }
+    suppressed_signals.clear();
+    for (auto tid: threads) {
+        ptrace(PTRACE_DETACH, tid, nullptr, nullptr);
+    }
+    threads.clear();
+}
+
+auto RemoteProcess::read(uintptr_t address, void *buffer, size_t size) -> Result<bool> {
+    iovec local{buffer, size};
+    iovec remote{(void *) address, size};
+    if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != ssize_t(size)) {
+        return Result<bool>(std::in_place_index<1>, "Reading process memory failed");
+    }
+    return Result<bool>(true);
+}
+
+auto RemoteProcess::write(uintptr_t address, const void *buffer, size_t size) -> Result<bool> {
+    iovec local{(void *) buffer, size};
+    iovec remote{(void *) address, size};
+    if (process_vm_writev(pid, &local, 1, &remote, 1, 0) == ssize_t(size)) {
+        return Result<bool>(true);
+    }
+
+    // process_vm_writev honours page protections. ptrace pokes do not. Words are read, modified and written back.
+    auto bytes = (const uint8_t *) buffer;
+    for (uintptr_t word_address = address & ~(sizeof(long) - 1); word_address < address + size;
+         word_address += sizeof(long)) {
+        errno = 0;
+        long word = ptrace(PTRACE_PEEKDATA, pid, (void *) word_address, nullptr);
+        if (errno) {
+            return Result<bool>(std::in_place_index<1>, "Writing process memory failed");
+        }
+        for (size_t i = 0; i < sizeof(long); ++i) {
+            if (word_address + i >= address && word_address + i < address + size) {
+                ((uint8_t *) &word)[i] = bytes[word_address + i - address];
+            }
+        }
+        if (ptrace(PTRACE_POKEDATA, pid, (void *) word_address, (void *) word)) {
+            return Result<bool>(std::in_place_index<1>, "Writing process memory failed");
+        }
+    }
+    return Result<bool>(true);
+}
+
+auto RemoteProcess::push_string(const string &str) -> Result<uintptr_t> {
+    if (!string_stack) {
+        user_regs_struct regs{};
+        if (ptrace(PTRACE_GETREGS, pid, nullptr, &regs)) {
+            return Result<uintptr_t>(std::in_place_index<1>, "ptrace GETREGS failed");
+        }
+        string_stack = regs.rsp - REMOTE_STACK_GAP;
+    }
+    string_stack -= str.size() + 1;
+    auto written = write(string_stack, str.c_str(), str.size() + 1);
+    if (written.index() != 0) {
+        return Result<uintptr_t>(std::in_place_index<1>, std::get<1>(written));
+    }
+    return Result<uintptr_t>(std::in_place_index<0>, string_stack);
+}
+
+auto RemoteProcess::call(uintptr_t function, std::initializer_list<uintptr_t> args) -> Result<uintptr_t> {
+    user_regs_struct saved{};
+    if (args.size() > 6 || ptrace(PTRACE_GETREGS, pid, nullptr, &saved)) {
+        return Result<uintptr_t>(std::in_place_index<1>, "ptrace GETREGS failed");
+    }
+
+    // The stack below the red zone and the pushed strings. The return address is 0, so that returning
+    // from the function faults and stops the process again.
+    auto regs = saved;
+    regs.rsp = (string_stack ? string_stack : saved.rsp - REMOTE_STACK_GAP) & ~uintptr_t(15);
+    regs.rsp -= sizeof(uintptr_t);
+    uintptr_t return_address = 0;
+    auto written = write(regs.rsp, &return_address, sizeof(return_address));
+    string_stack = 0;
+    if (written.index() != 0) {
+        return Result<uintptr_t>(std::in_place_index<1>, std::get<1>(written));
+    }
+
+    unsigned long long *arg_regs[] = {&regs.rdi, &regs.rsi, &regs.rdx, &regs.rcx, &regs.r8, &regs.r9};
+    size_t i = 0;
+    for (auto arg: args) {
+        *arg_regs[i++] = arg;
+    }
+    regs.rip = function;
+    regs.rax = 0;
+    // Do not restart an interrupted system call of the thread with our registers
+    regs.orig_rax = -1;
+    if (ptrace(PTRACE_SETREGS, pid, nullptr, &regs) || ptrace(PTRACE_CONT, pid, nullptr, nullptr)) {
+        ptrace(PTRACE_SETREGS, pid, nullptr, &saved);
+        return Result<uintptr_t>(std::in_place_index<1>, "ptrace CONT failed");
+    }
+
+    // Wait for the fault at the return address. Other signals are suppressed for the duration of the call
+    // and queued again on #detach.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REMOTE_CALL_TIMEOUT_MS);
+    int status = 0;
+    bool interrupted = false;
+    while (true) {
+        auto waited = waitpid(pid, &status, __WALL | (interrupted ? 0 : WNOHANG));
+        if (waited == 0) {
+            if (std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            } else if (!ptrace(PTRACE_INTERRUPT, pid, nullptr, nullptr)) {
+                interrupted = true;
+            } else {
+                break;
+            }
+            continue;
+        }
+        if (waited != pid || !WIFSTOPPED(status)) {
+            break;
+        }
+        // Group stops and the stop of PTRACE_INTERRUPT are reported as PTRACE_EVENT_STOP
+        bool event_stop = (status >> 16) == PTRACE_EVENT_STOP;
+        if (interrupted && event_stop) {
+            break;
+        }
+        if (!event_stop && WSTOPSIG(status) == SIGSEGV) {
+            break;
+        }
+        if (!event_stop) {
+            suppressed_signals.push_back(WSTOPSIG(status));
+        }
+        ptrace(PTRACE_CONT, pid, nullptr, nullptr);
+    }
+
+    if (interrupted) {
+        ptrace(PTRACE_SETREGS, pid, nullptr, &saved);
+        detach();
+        return Result<uintptr_t>(std::in_place_index<1>, "Remote call timed out");
+    }
+    user_regs_struct result{};
+    bool returned = WIFSTOPPED(status) && !ptrace(PTRACE_GETREGS, pid, nullptr, &result) && result.rip == 0;
+    ptrace(PTRACE_SETREGS, pid, nullptr, &saved);
+    if (!returned) {
+        return Result<uintptr_t>(std::in_place_index<1>, "Remote call crashed");
+    }
+    return Result<uintptr_t>(std::in_place_index<0>, result.rax);
+}
+
+bool RemoteProcess::is_executing(uintptr_t address, size_t size) {
+    for (auto tid: threads) {
+        user_regs_struct regs{};
+        if (!ptrace(PTRACE_GETREGS, tid, nullptr, &regs) && regs.rip > address && regs.rip < address + size) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,57 @@
+///! ptrace based access to another process: stopping all of its threads, reading and writing its memory
+///! and calling functions within it.
+#pragma once
+
+#include "runtime_patching_lib.h"
+
+#include <cstdint>
+#include <initializer_list>
+#include <sys/types.h>
+
+/// A traced process. All threads are stopped while attached. Detaches on destruction.
+class RemoteProcess {
+private:
+    pid_t pid;
+    std::vector<pid_t> threads;
+
+public:
+    explicit RemoteProcess(pid_t pid) noexcept : pid(pid) {}
+    RemoteProcess(const RemoteProcess &) = delete;
+    RemoteProcess &operator=(const RemoteProcess &) = delete;
+    ~RemoteProcess();
+
+    /// Attaches to and stops all threads of the process.
+    auto attach() -> Result<bool>;
+
+    /// True between #attach and #detach
+    bool is_attached() const { return !threads.empty(); }
+
+    /// Lets all threads continue and detaches from them. Signals the main thread received during #call are
+    /// delivered again.
+    void detach();
+
+    auto read(uintptr_t address, void *buffer, size_t size) -> Result<bool>;
+
+    /// Writes to the process memory. Read-only pages, like the .text section, are written via ptrace.
+    auto write(uintptr_t address, const void *buffer, size_t size) -> Result<bool>;
+
+    /// Calls a function with up to 6 integer arguments on the main thread of the process and returns its result.
+    /// Strings can be passed via #push_string. The main thread's registers are restored afterwards.
+    /// If the function does not return in time, it is interrupted wherever it is, the process is detached and an error
+    /// is returned. The process is left in an undefined state then, possibly holding locks the function took.
+    auto call(uintptr_t function, std::initializer_list<uintptr_t> args) -> Result<uintptr_t>;
+
+    /// Copies a string to the main thread's stack, below the red zone, and returns its address in the process.
+    /// Strings stay valid until the next #call.
+    auto push_string(const string &str) -> Result<uintptr_t>;
+
+    /// Returns true if any thread currently executes an instruction within [address, address + size),
+    /// except at the very first byte.
+    bool is_executing(uintptr_t address, size_t size);
+
+private:
+    /// The next free stack address for #push_string, 0 if none has been pushed since the last #call
+    uintptr_t string_stack = 0;
+    /// Signals the main thread received during #call, in order
+    std::vector<int> suppressed_signals;
+};
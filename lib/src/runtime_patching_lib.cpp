@@ -1,17 +1,61 @@
 #include "runtime_patching_lib.h"
+#include "patch_bundle.h"
+#include "patch_daemon.h"
 #include "vendor/json.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <filesystem>
+#include <algorithm>
 
 namespace fs = std::filesystem;
 using namespace std::chrono_literals;
 using namespace std::literals;
 using namespace nlohmann;
 
+void PatchRegistry::add_entry(Patch &&patch) {
+    if (!known_entries.emplace(patch.symbol_name, patch.new_version).second) {
+        return;
+    }
+    patch.generation = ++generation;
+
+    // Functions with an inlined copy or a clone of the patched function need the same patch
+    std::vector<Patch> copies;
+    if (inline_closure && patch.expanded_from.empty()) {
+        auto closure = inline_closure->copies.find(patch.symbol_name);
+        if (closure != inline_closure->copies.end()) {
+            for (auto &copy: closure->second) {
+                // Keyed apart from the real entries, so that a later real entry for the copy is still added
+                if (!known_expansions.emplace(patch.symbol_name, copy, patch.new_version).second) {
+                    continue;
+                }
+                copies.push_back(Patch{
+                        .new_version = patch.new_version,
+                        .about = patch.about,
+                        .symbol_name = copy,
+                        .patch_file = patch.patch_file,
+                        .generation = patch.generation,
+                        .expanded_from = patch.symbol_name,
+                });
+            }
+        }
+    }
+    cache.push_back(std::move(patch));
+    std::move(copies.begin(), copies.end(), std::back_inserter(cache));
+}
+
 auto PatchRegistry::get_patch_directory() -> Result<PatchRegistry::cache_pointer> {
+    // The daemon tells when there is something new, the cache never expires
+    if (daemon_client) {
+        auto polled = daemon_client->poll([this](Patch &&patch) { add_entry(std::move(patch)); });
+        if (auto error = std::get_if<std::string_view>(&polled)) {
+            std::cerr << "Failed to read from patch daemon " << registry_uri << ": " << *error << "\n";
+            return Result<PatchRegistry::cache_pointer>(*error);
+        }
+        return Result<PatchRegistry::cache_pointer>(&cache);
+    }
+
     auto now = std::chrono::system_clock::now();
     auto diff = now - this->cache_time;
 
@@ -20,114 +64,524 @@ auto PatchRegistry::get_patch_directory() -> Result<PatchRegistry::cache_pointer
         this->cache_time = now;
         // Load registry meta data
         fs::path registry_url = fs::current_path() / this->registry_uri;
-        std::ifstream i(registry_url);
+        std::shared_ptr<PatchBundle> bundle;
         string str;
-        if (i) {
-            std::ostringstream ss;
-            ss << i.rdbuf();
-            str = ss.str();
+        if (registry_url.extension() == ".bundle") {
+            bundle = std::make_shared<PatchBundle>();
+            auto opened = bundle->open(registry_url);
+            if (auto error = std::get_if<std::string_view>(&opened)) {
+                std::cerr << "Failed to open " << registry_url << ": " << *error << "\n";
+                return Result<PatchRegistry::cache_pointer>(*error);
+            }
+            auto meta = bundle->member(BUNDLE_REGISTRY_NAME);
+            if (!meta) {
+                std::cerr << "Did not find " << BUNDLE_REGISTRY_NAME << " in " << registry_url << "\n";
+                return Result<PatchRegistry::cache_pointer>("File not found");
+            }
+            str = *meta;
         } else {
-            std::cerr << "Did not find " << registry_url << "\n";
-            return Result<PatchRegistry::cache_pointer>("File not found");
+            std::ifstream i(registry_url);
+            if (i) {
+                std::ostringstream ss;
+                ss << i.rdbuf();
+                str = ss.str();
+            } else {
+                std::cerr << "Did not find " << registry_url << "\n";
+                return Result<PatchRegistry::cache_pointer>("File not found");
+            }
         }
 
-        // Parse json
+        // Parse json. Only entries that are not yet known are added, each with a new generation.
         auto j = json::parse(str);
+        auto cache_size = cache.size();
         for (auto &element : j) {
-            cache.emplace_back(Patch{
-                    .new_version = element["new_version"].get<int>(),
+            auto key = std::make_pair(element["symbol_name"].get<std::string>(), element["new_version"].get<int>());
+            if (known_entries.count(key)) {
+                continue;
+            }
+            auto patch_file = element["patch_file"].get<std::string>();
+            // Patch objects of a bundle are resolved to in-memory files
+            if (bundle) {
+                auto path = bundle->materialise(patch_file);
+                if (auto error = std::get_if<std::string_view>(&path)) {
+                    std::cerr << "Failed to load " << patch_file << " from " << registry_url << ": " << *error << "\n";
+                    continue;
+                }
+                patch_file = std::get<string>(path);
+            }
+            add_entry(Patch{
+                    .new_version = key.second,
                     .about = element["about"].get<std::string>(),
-                    .symbol_name = element["symbol_name"].get<std::string>(),
-                    .patch_file = element["patch_file"].get<std::string>(),
+                    .symbol_name = std::move(key.first),
+                    .patch_file = std::move(patch_file),
             });
         }
+        if (bundle && cache.size() != cache_size) {
+            bundles.push_back(std::move(bundle));
+        }
     }
 
     return Result<PatchRegistry::cache_pointer>(&cache);
 }
 
-PatchRegistry::PatchRegistry(std::string registry_uri) noexcept : registry_uri(std::move(registry_uri)) {
+auto PatchRegistry::get_patch_directory_since(generation_t since) -> Result<PatchRange> {
+    auto cache_result = get_patch_directory();
+    if (auto error = std::get_if<std::string_view>(&cache_result)) {
+        return Result<PatchRange>(*error);
+    }
+
+    // The cache is ordered by generation
+    auto first = std::upper_bound(cache.begin(), cache.end(), since, [](generation_t g, const Patch &patch) {
+        return g < patch.generation;
+    });
+    return Result<PatchRange>(PatchRange{cache.data() + (first - cache.begin()), cache.data() + cache.size()});
+}
+
+PatchRegistry::PatchRegistry(std::string registry_uri, std::shared_ptr<const InlineClosure> inline_closure) noexcept
+        : registry_uri(std::move(registry_uri)), inline_closure(std::move(inline_closure)) {
+    if (this->registry_uri.rfind(DAEMON_URI_PREFIX, 0) == 0) {
+        daemon_client = std::make_shared<PatchDaemonClient>(
+                this->registry_uri.substr(sizeof(DAEMON_URI_PREFIX) - 1));
+    }
 }
 
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <cstring>
+#include <map>
 #include <utility>
 
+#include "elf_symbols.h"
 #include "lde_minimal.h"
+#include "patchability.h"
 #include "make_jmp.h"
+#include "parallel_for.h"
 
 #define NOP_OPCODE  0x90
 
-void perform_patch(const Patch &patch, Patchable &patchable) {
-    fs::path patch_file = fs::current_path() / patch.patch_file;
+/// A registry entry that has been matched to a patchable. The patch object is loaded and the jump is planned
+/// by #prepare_patches, possibly on another thread. Nothing has been written to the target yet.
+struct PreparedPatch {
+    const Patch *patch;
+    Patchable *patchable;
+    void *patched_function = nullptr;
+    /// The size of the jump instruction
+    size_t min_size = 0;
+    /// The size of all instructions that are touched by the jump instruction
+    size_t actual_size = 0;
+    /// The bytes from the target address to the end of its function, if the patchability map does not know
+    /// the target. From the ELF symbol. 0 if unknown.
+    uint64_t function_size = 0;
+    /// Set if the preparation failed. Reported by #commit_patch, so that the log is not interleaved.
+    string error = {};
+    /// Set with #error if the failure can go away by itself, because the patch file has not been deployed yet
+    bool retryable = false;
+};
+
+/// Reads a file into the page cache, so that dlopen does not wait for the disk while holding the loader lock.
+static void prefault_file(const fs::path &file) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st{};
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        auto mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+/// Loads the patch object of the given prepared patches, resolves the symbols and computes the overwrite lengths.
+/// All given patches must share the same patch file. The overwrite lengths are taken from the patchability map,
+/// if given and if it knows the target, and computed by the length disassembler otherwise.
+///
+/// glibc holds its loader lock for the whole dlopen, including mapping and relocating the object, so loading is
+/// serialised across workers. Everything that does not need the loader runs first, overlapping with the dlopen
+/// of other workers: Reading the patch file into the page cache and analysing the target prologues.
+static void prepare_patch_file(std::vector<PreparedPatch *> &prepared, const PatchabilityMap *patchability) {
+    auto &patch_file_name = prepared.front()->patch->patch_file;
+    fs::path patch_file = fs::current_path() / patch_file_name;
+    prefault_file(patch_file);
+
+    std::vector<FunctionPatchability> targets(prepared.size());
+    for (size_t i = 0; i < prepared.size(); ++i) {
+        auto &patchable = *prepared[i]->patchable;
+        // Vtable changes do not need an instruction analysis
+        if (patchable.vtable_index >= 0) {
+            continue;
+        }
+        if (auto known = patchability ? patchability->find(patchable.address) : nullptr) {
+            targets[i] = *known;
+        } else if (prepared[i]->function_size) {
+            // The size keeps the jump from overwriting the following function
+            targets[i].size = prepared[i]->function_size;
+            analyse_prologue((const uint8_t *) patchable.address, targets[i]);
+        }
+    }
+
     auto handle = dlopen(patch_file.c_str(), RTLD_NOW);
     if (!handle) {
-        std::cerr << "Failed to load shared library " << patch.patch_file << "!\n" << dlerror() << "\n";
+        auto error = "Failed to load shared library "s + patch_file_name + "!\n" + dlerror();
+        std::error_code ec;
+        bool deployed = fs::exists(patch_file, ec);
+        for (auto p: prepared) {
+            p->error = error;
+            p->retryable = !deployed;
+        }
         return;
     }
-    auto patched_function = dlsym(handle, patch.symbol_name.c_str());
-    if (!patched_function) {
-        std::cerr << "dlsym failed. Did not find " << patch.symbol_name << "!\n";
-        return;
+    release_materialised(patch_file_name, handle);
+
+    for (size_t i = 0; i < prepared.size(); ++i) {
+        auto p = prepared[i];
+        p->patched_function = dlsym(handle, p->patch->symbol_name.c_str());
+        if (!p->patched_function) {
+            p->error = "dlsym failed. Did not find " + p->patch->symbol_name + "!";
+            continue;
+        }
+        if (p->patchable->vtable_index >= 0) {
+            continue;
+        }
+        p->min_size = get_jmp_size(p->patchable->address, p->patched_function);
+        p->actual_size = p->min_size == sizeof(JumpInsn) ? targets[i].jmp32_overwrite : targets[i].jmp64_overwrite;
+        if (!targets[i].size) {
+            p->error = "Not patchable. The size of " + p->patch->symbol_name + " is unknown!";
+        } else if (!p->actual_size) {
+            p->error = "Not patchable. " + p->patch->symbol_name + " is too small or has an unknown prologue!";
+        }
+    }
+}
+
+/// Prepares all given patches. Patches of different patch files are prepared concurrently on up to `workers` threads.
+static void prepare_patches(std::vector<PreparedPatch> &prepared, unsigned workers,
+                            const PatchabilityMap *patchability) {
+    std::map<string, std::vector<PreparedPatch *>> by_file;
+    for (auto &p: prepared) {
+        by_file[p.patch->patch_file].push_back(&p);
+    }
+    std::vector<std::vector<PreparedPatch *> *> files;
+    for (auto &entry: by_file) {
+        files.push_back(&entry.second);
     }
 
-    // Align pointer to page size
-    void *page = (void *) (uintptr_t(patchable.address) & ~(getpagesize() - 1));
-    size_t min_size = get_jmp_size(patchable.address, patched_function);
-    size_t actual_size = disasm_until(patchable.address, min_size);
+    parallel_for(files.size(), workers, [&](size_t i) {
+        prepare_patch_file(*files[i], patchability);
+    });
+}
 
-    if (!actual_size) {
-        std::cerr << "disasm_until failed. Address invalid " << patchable.address << "!\n";
-        return;
+/// Writes a prepared patch to the target. Must not run concurrently with another commit.
+/// The written pages get their protection from `mappings` back. Returns false if the patch has not been applied.
+static bool commit_patch(const PreparedPatch &prepared, const std::vector<MemoryMapping> &mappings) {
+    auto &patch = *prepared.patch;
+    auto &patchable = *prepared.patchable;
+    if (!prepared.error.empty()) {
+        std::cerr << prepared.error << "\n";
+        return false;
     }
 
-    // Make the page with the target function writable
-    if (mprotect(page, actual_size, PROT_WRITE | PROT_READ | PROT_EXEC))
+    // The bytes that are written: A vtable slot, or the overwritten prologue instructions
+    bool vtable = patchable.vtable_index >= 0;
+    auto address = vtable ? (void *) (static_cast<intptr_t *>(patchable.address) + patchable.vtable_index)
+                          : patchable.address;
+    size_t size = vtable ? sizeof(intptr_t) : prepared.actual_size;
+
+    // Make all pages of the written range writable
+    auto page_size = (uintptr_t) getpagesize();
+    auto first_page = (uintptr_t) address & ~(page_size - 1);
+    auto pages_size = (((uintptr_t) address + size + page_size - 1) & ~(page_size - 1)) - first_page;
+    if (mprotect((void *) first_page, pages_size, PROT_WRITE | PROT_READ | PROT_EXEC)) {
         perror("Please disable seccomp, SELinux, AppArmor. mprotect call failed!");
+        return false;
+    }
 
     // The easy part: It is a vtable change
-    if (patchable.vtable_index >= 0) {
-        auto a = static_cast<intptr_t *>(patchable.address) + patchable.vtable_index;
-        *a = (intptr_t) patched_function;
+    if (vtable) {
+        *static_cast<intptr_t *>(address) = (intptr_t) prepared.patched_function;
     } else {
         // The stack including the return address and ECX register (for c++ member functions)
         // are already prepared. We just want to jump. Write the jmp instruction right at the front of the target functions address.
         // This does not account for too-small target functions. Those are expected to be at least as big as the used jmp.
-        make_jmp(patchable.address, patched_function);
+        make_jmp(patchable.address, prepared.patched_function);
         // Fill with NOPs
-        for (size_t addr = min_size; addr < actual_size; ++addr) {
+        for (size_t addr = prepared.min_size; addr < prepared.actual_size; ++addr) {
             *((uint8_t *) patchable.address + addr) = NOP_OPCODE;
         }
     }
 
-    // Make the page with the target function non-writable. VirtualProtect on Windows.
-    if (mprotect(page, getpagesize(), PROT_READ | PROT_EXEC))
-        perror("Please disable seccomp, SELinux, AppArmor. mprotect call failed!");
+    // Restore the protection of every page. Usually read-only: code, or vtables in RELRO. VirtualProtect on Windows.
+    for (auto page = first_page; page < first_page + pages_size; page += page_size) {
+        auto mapping = find_memory_mapping(mappings, page);
+        int protection = mapping ? mapping->protection : vtable ? PROT_READ : PROT_READ | PROT_EXEC;
+        if (mprotect((void *) page, page_size, protection))
+            perror("Please disable seccomp, SELinux, AppArmor. mprotect call failed!");
+    }
 
-    patchable.current_version = patch.new_version;
     std::clog << "Patched " << patch.symbol_name << " to " << patch.new_version << "\n";
+    return true;
 }
 
-void patch_now(Patchables &patchables, PatchRegistry &patch_registry) {
-    auto cache_result = patch_registry.get_patch_directory();
-    auto cache = std::get_if<PatchRegistry::cache_pointer>(&cache_result);
-    if (!cache) {
+/// The newest version per (symbol_name, expanded_from, patch_file) of all registry entries. A patch object carries
+/// the fix of every entry that names it, and those of the older versions of the same function.
+using CarriedFixes = std::map<std::tuple<string, string, string>, int>;
+
+static CarriedFixes carried_fixes(const PatchRange &entries) {
+    CarriedFixes carried;
+    for (auto &entry: entries) {
+        auto &version = carried[{entry.symbol_name, entry.expanded_from, entry.patch_file}];
+        version = std::max(version, entry.new_version);
+    }
+    return carried;
+}
+
+/// The version of the fixes the patchable runs from the function `expanded_from`, or of its own if empty.
+static int applied_version(const Patchable &patchable, const string &expanded_from) {
+    if (expanded_from.empty()) {
+        return patchable.current_version;
+    }
+    for (auto &expansion: patchable.expansions) {
+        if (expansion.first == expanded_from) {
+            return expansion.second;
+        }
+    }
+    return 0;
+}
+
+/// Returns a fix the patchable runs but the patch object of `patch` does not carry, or an empty string if it
+/// carries all of them. Applying it would silently revert that fix.
+static string missing_fix(const Patch &patch, const Patchable &patchable, const CarriedFixes &carried) {
+    auto carries = [&](const string &expanded_from, int version) {
+        auto it = carried.find({patchable.symbol_name, expanded_from, patch.patch_file});
+        return it != carried.end() && it->second >= version;
+    };
+    if (!patch.expanded_from.empty() && patchable.current_version > 0
+        && !carries({}, patchable.current_version)) {
+        return patchable.symbol_name + " version " + std::to_string(patchable.current_version);
+    }
+    for (auto &[expanded_from, version]: patchable.expansions) {
+        if (expanded_from != patch.expanded_from && !carries(expanded_from, version)) {
+            return expanded_from + " version " + std::to_string(version);
+        }
+    }
+    return {};
+}
+
+/// Records the versions of all fixes the patch object of an applied patch carries for the patchable.
+static void record_fixes(const Patch &patch, Patchable &patchable, const CarriedFixes &carried) {
+    auto raise = [&](const string &expanded_from, int version) {
+        if (expanded_from.empty()) {
+            patchable.current_version = std::max(patchable.current_version, version);
+            return;
+        }
+        for (auto &expansion: patchable.expansions) {
+            if (expansion.first == expanded_from) {
+                expansion.second = std::max(expansion.second, version);
+                return;
+            }
+        }
+        patchable.expansions.emplace_back(expanded_from, version);
+    };
+    raise(patch.expanded_from, patch.new_version);
+    for (auto it = carried.lower_bound({patchable.symbol_name, {}, {}});
+         it != carried.end() && std::get<0>(it->first) == patchable.symbol_name; ++it) {
+        if (std::get<2>(it->first) == patch.patch_file) {
+            raise(std::get<1>(it->first), it->second);
+        }
+    }
+}
+
+/// Returns the function patchable that expanded entries of the given symbol are applied to, or nullptr.
+/// Vtable patchables replace the vtable slot only, so their code is patched via a copy.
+static Patchable *own_patchable(Patchables &patchables, const string &symbol_name) {
+    auto own = std::find_if(patchables.begin(), patchables.end(), [&](const Patchable &p) {
+        return p.symbol_name == symbol_name && p.vtable_index < 0;
+    });
+    return own != patchables.end() ? &*own : nullptr;
+}
+
+/// Copies of functions that have been appended as patchables since are merged into them, so that every function
+/// has a single version state.
+static void merge_copies(Patchables &patchables) {
+    for (auto it = patchables.copies.begin(); it != patchables.copies.end();) {
+        auto own = own_patchable(patchables, it->symbol_name);
+        if (!own) {
+            ++it;
+            continue;
+        }
+        for (auto &expansion: it->expansions) {
+            if (applied_version(*own, expansion.first) < expansion.second) {
+                own->expansions.push_back(expansion);
+            }
+        }
+        it = patchables.copies.erase(it);
+    }
+}
+
+/// Adds copy patchables for registry entries that have been expanded to inlined copies or clones of a patched
+/// function, one per function that is not a patchable of its own. Their addresses are taken from the patchability
+/// map.
+static void add_expanded_patchables(Patchables &patchables, const PatchRange &entries) {
+    std::map<string, uintptr_t> addresses;
+    for (auto &entry: entries) {
+        if (entry.expanded_from.empty() || own_patchable(patchables, entry.symbol_name)
+            || std::any_of(patchables.copies.begin(), patchables.copies.end(), [&](const Patchable &p) {
+                return p.symbol_name == entry.symbol_name;
+            })) {
+            continue;
+        }
+        if (!patchables.patchability) {
+            std::cerr << "Not patching " << entry.symbol_name << ", which contains a copy of "
+                      << entry.expanded_from << ". A patchability map is required to find it!\n";
+            continue;
+        }
+        if (addresses.empty()) {
+            for (auto &f: patchables.patchability->functions) {
+                addresses.emplace(f.symbol_name, patchables.patchability->load_base + f.address);
+            }
+        }
+        auto address = addresses.find(entry.symbol_name);
+        if (address == addresses.end()) {
+            std::cerr << "Did not find " << entry.symbol_name << ", which contains a copy of "
+                      << entry.expanded_from << "!\n";
+            continue;
+        }
+        patchables.copies.push_back(Patchable{.address = (void *) address->second, .symbol_name = entry.symbol_name});
+    }
+}
+
+void patch_now(Patchables &patchables, PatchRegistry &patch_registry, unsigned workers) {
+    merge_copies(patchables);
+    // Patchables added since the last call also need the entries that have been consumed before
+    auto known_patchables = std::min(patchables.known_patchables, patchables.size());
+    auto known_copies = patchables.copies.size();
+    bool added = known_patchables < patchables.size();
+    auto cache_result = patch_registry.get_patch_directory_since(added ? 0 : patchables.consumed_generation);
+    auto new_entries = std::get_if<PatchRange>(&cache_result);
+    if (!new_entries) {
         std::cerr << "Failed to get registry cache pointer!\n";
         return;
     }
+    add_expanded_patchables(patchables, *new_entries);
 
-    for (auto &cache_entry: **cache) {
-        for (auto &patchable: patchables) {
-            if (cache_entry.symbol_name == patchable.symbol_name) {
-                if (cache_entry.new_version <= patchable.current_version) {
-                    std::clog << "Not patching " << cache_entry.symbol_name << ". Already up to date\n";
-                    continue;
-                }
-                std::clog << "Patching " << cache_entry.symbol_name << " to " << cache_entry.new_version << "\n";
-                perform_patch(cache_entry, patchable);
-            }
+    // Failed entries of earlier calls are retried first, then the new ones are processed in registry order
+    auto retried = std::move(patchables.pending);
+    patchables.pending.clear();
+    std::vector<const Patch *> candidates;
+    for (auto &entry: retried) {
+        candidates.push_back(&entry);
+    }
+    for (auto &entry: *new_entries) {
+        candidates.push_back(&entry);
+    }
+
+    // Only the newest entry per patchable and patched function is applied. Older ones in the same batch would be
+    // overwritten anyway. Expanded entries go to the patchable of the containing function, or to its copy patchable.
+    std::map<std::pair<Patchable *, string>, const Patch *> newest;
+    std::vector<const Patch *> deferred;
+    auto match = [&](const Patch *cache_entry, Patchable &patchable, bool consumed, bool copy) {
+        if (cache_entry->symbol_name != patchable.symbol_name || consumed) {
+            return;
+        }
+        bool expanded = !cache_entry->expanded_from.empty();
+        if (copy ? !expanded : expanded && patchable.vtable_index >= 0) {
+            return;
         }
+        if (cache_entry->new_version <= applied_version(patchable, cache_entry->expanded_from)) {
+            std::clog << "Not patching " << cache_entry->symbol_name << ". Already up to date\n";
+            return;
+        }
+        if (patchable.canary_running) {
+            deferred.push_back(cache_entry);
+            return;
+        }
+        auto &entry = newest[{&patchable, cache_entry->expanded_from}];
+        if (!entry || entry->new_version < cache_entry->new_version) {
+            entry = cache_entry;
+        }
+    };
+    // Entries of consumed generations only go to the patchables and copies that are new to this call
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        bool consumed = i >= retried.size() && candidates[i]->generation <= patchables.consumed_generation;
+        for (size_t j = 0; j < patchables.size(); ++j) {
+            match(candidates[i], patchables[j], consumed && j < known_patchables, false);
+        }
+        for (size_t j = 0; j < patchables.copies.size(); ++j) {
+            match(candidates[i], patchables.copies[j], consumed && j < known_copies, true);
+        }
+    }
+
+    // Keep the registry order for committing
+    std::vector<PreparedPatch> prepared;
+    auto add_prepared = [&](Patchable &patchable) {
+        for (auto it = newest.lower_bound({&patchable, {}}); it != newest.end() && it->first.first == &patchable; ++it) {
+            prepared.push_back(PreparedPatch{.patch = it->second, .patchable = &patchable});
+        }
+    };
+    std::for_each(patchables.begin(), patchables.end(), add_prepared);
+    std::for_each(patchables.copies.begin(), patchables.copies.end(), add_prepared);
+    std::stable_sort(prepared.begin(), prepared.end(), [](const PreparedPatch &a, const PreparedPatch &b) {
+        return a.patch->generation < b.patch->generation;
+    });
+
+    // Targets the patchability map does not know are bounded by their ELF symbols
+    std::vector<const void *> unknown_targets;
+    std::vector<PreparedPatch *> unknown_prepared;
+    for (auto &p: prepared) {
+        auto known = patchables.patchability ? patchables.patchability->find(p.patchable->address) : nullptr;
+        if (p.patchable->vtable_index < 0 && !known) {
+            unknown_targets.push_back(p.patchable->address);
+            unknown_prepared.push_back(&p);
+        }
+    }
+    auto functions = find_elf_functions(unknown_targets);
+    for (size_t i = 0; i < functions.size(); ++i) {
+        if (functions[i].size) {
+            unknown_prepared[i]->function_size =
+                    functions[i].size - ((uintptr_t) unknown_targets[i] - functions[i].address);
+        }
+    }
+
+    prepare_patches(prepared, workers ? workers : default_worker_count(), patchables.patchability.get());
+
+    // The protections of the written pages are restored afterwards. Every function runs all fixes applied to it,
+    // its own and those of the functions it contains copies of. A patch object must carry all of them.
+    auto mappings = read_memory_mappings();
+    CarriedFixes carried;
+    if (!prepared.empty()) {
+        auto all_entries = patch_registry.get_patch_directory_since(0);
+        if (auto range = std::get_if<PatchRange>(&all_entries)) {
+            carried = carried_fixes(*range);
+        }
+    }
+    for (auto &p: prepared) {
+        // An earlier patch of this batch may have carried this one already
+        if (p.patch->new_version <= applied_version(*p.patchable, p.patch->expanded_from)) {
+            continue;
+        }
+        std::clog << "Patching " << p.patch->symbol_name << " to " << p.patch->new_version
+                  << (p.patch->expanded_from.empty() ? "" : " (contains " + p.patch->expanded_from + ")") << "\n";
+        if (auto missing = missing_fix(*p.patch, *p.patchable, carried); !missing.empty()) {
+            std::cerr << "Not patching " << p.patch->symbol_name << ". Its patch object lacks the applied fix of "
+                      << missing << "!\n";
+            continue;
+        }
+        if (commit_patch(p, mappings)) {
+            record_fixes(*p.patch, *p.patchable, carried);
+        } else if (p.retryable) {
+            std::clog << "Retrying " << p.patch->symbol_name << " with the next patch\n";
+            patchables.pending.push_back(*p.patch);
+        }
+    }
+    // The prologue of a canary function jumps to its dispatcher until the canary is promoted or aborted
+    for (auto entry: deferred) {
+        std::clog << "Deferring " << entry->symbol_name << " until its canary has finished\n";
+        patchables.pending.push_back(*entry);
     }
+    patchables.consumed_generation = patch_registry.current_generation();
+    patchables.known_patchables = patchables.size();
 }
@@ -0,0 +1,188 @@
+#include "gtest/gtest.h"
+#include "runtime_patching_lib.h"
+
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+using ::testing::InitGoogleTest;
+
+/// Patched by tests/test_patch.cpp to return x + 2
+FORCE_NO_INLINE int canary_target(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+static int call_target(int x) {
+    int (*volatile function)(int) = &canary_target;
+    return function(x);
+}
+
+/// Patched by tests/test_patch.cpp to return base + x + 2
+struct CanaryConstTarget {
+    int base;
+    FORCE_NO_INLINE int value(int x) const {
+        volatile int result = base + x;
+        result = result + 1;
+        return result;
+    }
+};
+
+/// Too small for a 64bit jump. Patched by tests/test_patch.cpp to return 2
+FORCE_NO_INLINE int small_canary_target() {
+    return 1;
+}
+
+/// Patched by tests/test_patch.cpp to return x + 2
+FORCE_NO_INLINE int deferred_canary_target(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+struct CanaryTest : public ::testing::Test {
+    fs::path meta = fs::temp_directory_path() / "runtime_patching_canary_test.json";
+    Patchables patchables;
+
+    void SetUp() override {
+        std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z13canary_targeti", )"
+                            << R"("patch_file": ")" << TEST_PATCH_FILE << R"("}, )"
+                            << R"({"new_version": 1, "about": "", "symbol_name": "_ZNK17CanaryConstTarget5valueEi", )"
+                            << R"("patch_file": ")" << TEST_PATCH_FILE << R"("}, )"
+                            << R"({"new_version": 1, "about": "", "symbol_name": "_Z19small_canary_targetv", )"
+                            << R"("patch_file": ")" << TEST_PATCH_FILE << R"("}])";
+        patchables.emplace_back(Patchable{.address = (void *) &canary_target, .symbol_name = "_Z13canary_targeti"});
+    }
+
+    void TearDown() override {
+        fs::remove(meta);
+    }
+};
+
+TEST_F(CanaryTest, RoutesAndAborts) {
+    PatchRegistry registry(meta.string());
+    auto started = start_canary<&canary_target>(patchables[0], registry, 0.5);
+    ASSERT_TRUE(std::holds_alternative<Canary *>(started)) << std::get<std::string_view>(started);
+    auto canary = std::get<Canary *>(started);
+    EXPECT_EQ(patchables[0].current_version, 1);
+
+    // Both versions are called, with about the requested fraction
+    int patched = 0;
+    for (int i = 0; i < 1000; ++i) {
+        auto result = call_target(1);
+        ASSERT_TRUE(result == 2 || result == 3);
+        patched += result == 3;
+    }
+    EXPECT_GT(patched, 350);
+    EXPECT_LT(patched, 650);
+
+    // Routing overrides the fraction for the calling thread only
+    canary->route_current_thread(CanaryRoute::Original);
+    int other_thread_patched = 0;
+    std::thread other([&]() {
+        canary->set_fraction(1);
+        other_thread_patched = call_target(1) == 3;
+    });
+    other.join();
+    EXPECT_EQ(other_thread_patched, 1);
+    EXPECT_EQ(call_target(1), 2);
+
+    auto report = canary->report();
+    EXPECT_EQ(report.original.count() + report.patched.count(), 1002u);
+    EXPECT_EQ(report.patched.count(), uint64_t(patched) + 1);
+    EXPECT_GT(report.original.quantile_ns(0.5), 0u);
+
+    ASSERT_TRUE(std::holds_alternative<bool>(canary->abort()));
+    EXPECT_EQ(call_target(1), 2);
+    EXPECT_EQ(patchables[0].current_version, 0);
+    EXPECT_FALSE(std::holds_alternative<bool>(canary->promote()));
+
+    // The same function can be tested again after a canary has finished
+    started = start_canary<&canary_target>(patchables[0], registry, 0);
+    ASSERT_TRUE(std::holds_alternative<Canary *>(started));
+    canary = std::get<Canary *>(started);
+    EXPECT_EQ(call_target(1), 2);
+    ASSERT_TRUE(std::holds_alternative<bool>(canary->promote()));
+    EXPECT_EQ(call_target(1), 3);
+    EXPECT_EQ(patchables[0].current_version, 1);
+}
+
+TEST_F(CanaryTest, NoNewerPatch) {
+    PatchRegistry registry(meta.string());
+    patchables[0].current_version = 1;
+    auto started = start_canary<&canary_target>(patchables[0], registry, 0.5);
+    EXPECT_TRUE(std::holds_alternative<std::string_view>(started));
+}
+
+TEST_F(CanaryTest, ConstMemberFunction) {
+    PatchRegistry registry(meta.string());
+    Patchable patchable{.address = cpp_class_member_address(&CanaryConstTarget::value),
+                        .symbol_name = "_ZNK17CanaryConstTarget5valueEi"};
+    auto started = start_canary<&CanaryConstTarget::value>(patchable, registry, 0);
+    ASSERT_TRUE(std::holds_alternative<Canary *>(started)) << std::get<std::string_view>(started);
+    auto canary = std::get<Canary *>(started);
+
+    const CanaryConstTarget target{10};
+    const CanaryConstTarget *volatile object = &target;
+    EXPECT_EQ(object->value(1), 12);
+    canary->route_current_thread(CanaryRoute::Patched);
+    EXPECT_EQ(object->value(1), 13);
+    ASSERT_TRUE(std::holds_alternative<bool>(canary->promote()));
+    EXPECT_EQ(object->value(1), 13);
+}
+
+TEST_F(CanaryTest, RefusesFunctionsTooSmallForTheJump) {
+    PatchRegistry registry(meta.string());
+    Patchable patchable{.address = (void *) &small_canary_target, .symbol_name = "_Z19small_canary_targetv"};
+    auto started = start_canary<&small_canary_target>(patchable, registry, 1);
+    EXPECT_TRUE(std::holds_alternative<std::string_view>(started));
+    int (*volatile function)() = &small_canary_target;
+    EXPECT_EQ(function(), 1);
+    EXPECT_EQ(patchable.current_version, 0);
+}
+
+TEST_F(CanaryTest, PatchNowWaitsForTheCanary) {
+    auto newer_meta = fs::temp_directory_path() / "runtime_patching_canary_newer_test.json";
+    for (auto [file, versions]: {std::pair{meta, 1}, std::pair{newer_meta, 2}}) {
+        std::ofstream o(file);
+        o << "[";
+        for (int version = 1; version <= versions; ++version) {
+            o << (version > 1 ? ", " : "") << R"({"new_version": )" << version
+              << R"(, "about": "", "symbol_name": "_Z22deferred_canary_targeti", "patch_file": ")"
+              << TEST_PATCH_FILE << R"("})";
+        }
+        o << "]";
+    }
+    Patchables deferred;
+    deferred.emplace_back(Patchable{.address = (void *) &deferred_canary_target,
+                                    .symbol_name = "_Z22deferred_canary_targeti"});
+    int (*volatile function)(int) = &deferred_canary_target;
+
+    PatchRegistry registry(meta.string());
+    auto started = start_canary<&deferred_canary_target>(deferred[0], registry, 0);
+    ASSERT_TRUE(std::holds_alternative<Canary *>(started)) << std::get<std::string_view>(started);
+    auto canary = std::get<Canary *>(started);
+
+    // A newer patch waits until the canary has finished, instead of overwriting the jump to the dispatcher
+    PatchRegistry newer_registry(newer_meta.string());
+    patch_now(deferred, newer_registry);
+    ASSERT_EQ(deferred.pending.size(), 1u);
+    EXPECT_EQ(deferred.pending[0].new_version, 2);
+    EXPECT_EQ(deferred[0].current_version, 1);
+    EXPECT_EQ(function(1), 2);
+
+    ASSERT_TRUE(std::holds_alternative<bool>(canary->abort()));
+    patch_now(deferred, newer_registry);
+    EXPECT_TRUE(deferred.pending.empty());
+    EXPECT_EQ(deferred[0].current_version, 2);
+    EXPECT_EQ(function(1), 3);
+    fs::remove(newer_meta);
+}
+
+int main(int argc, char **argv) {
+    InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
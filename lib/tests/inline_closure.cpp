@@ -0,0 +1,176 @@
+#include "gtest/gtest.h"
+#include "runtime_patching_lib.h"
+
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+using ::testing::InitGoogleTest;
+
+/* Written by GCC 12 for:
+ *   static int helper(int x, int y) { return x * y + 3; }
+ *   int fixme(int a) { return helper(a, 3) + 1; }
+ *   int caller1(int a) { return fixme(a) * 2; }
+ *   int caller2(int a) { return fixme(a + 1) - 1; }
+ *   __attribute__((noinline)) static int cp(int a, int b) { ... }
+ *   int user(int a) { return cp(a, 10) + cp(a + 1, 10); }
+ */
+static const char *IPA_CLONES = R"(Callgraph clone;_ZL6helperii;0;t.cpp;1;12;_Z5fixmei;1;t.cpp;2;5;inlining to
+Callgraph removal;_ZL6helperii;0;t.cpp;1;12
+Callgraph clone;_Z5fixmei;1;t.cpp;2;5;_Z7caller1i;2;t.cpp;3;5;inlining to
+Callgraph clone;_Z5fixmei;1;t.cpp;2;5;_Z7caller2i;3;t.cpp;4;5;inlining to
+Callgraph clone;_ZL2cpii;4;t.cpp;5;38;_ZL2cpii.constprop.0;8;t.cpp;5;38;constprop
+)";
+
+TEST(RunTimePatchingTests, InlineClosureFromIpaClones) {
+    auto dump = fs::temp_directory_path() / "runtime_patching_test.cpp.000i.ipa-clones";
+    std::ofstream(dump) << IPA_CLONES;
+
+    auto result = read_ipa_clones({dump.string()});
+    auto closure = std::get_if<InlineClosure>(&result);
+    ASSERT_NE(closure, nullptr);
+    // Transitive: helper has been inlined into fixme, which has been inlined into both callers
+    EXPECT_EQ(closure->copies["_ZL6helperii"], (std::set<string>{"_Z5fixmei", "_Z7caller1i", "_Z7caller2i"}));
+    EXPECT_EQ(closure->copies["_Z5fixmei"], (std::set<string>{"_Z7caller1i", "_Z7caller2i"}));
+    EXPECT_EQ(closure->copies["_ZL2cpii"], (std::set<string>{"_ZL2cpii.constprop.0"}));
+    EXPECT_EQ(closure->copies.count("_Z7caller1i"), 0u);
+
+    auto closure_file = fs::temp_directory_path() / "runtime_patching_inline_closure.json";
+    ASSERT_TRUE(std::holds_alternative<bool>(write_inline_closure(closure_file.string(), *closure)));
+    auto loaded = load_inline_closure(closure_file.string());
+    auto loaded_closure = std::get_if<std::shared_ptr<const InlineClosure>>(&loaded);
+    ASSERT_NE(loaded_closure, nullptr);
+    EXPECT_EQ((*loaded_closure)->copies, closure->copies);
+
+    fs::remove(dump);
+    fs::remove(closure_file);
+}
+
+TEST(RunTimePatchingTests, RegistryExpandsInlineClosure) {
+    auto closure = std::make_shared<InlineClosure>();
+    closure->copies["_Z5fixmei"] = {"_Z7caller1i", "_Z7caller2i"};
+    auto meta = fs::temp_directory_path() / "runtime_patching_expand_test.json";
+    std::ofstream(meta) << R"([{"new_version": 2, "about": "fix", "symbol_name": "_Z5fixmei", "patch_file": "p.so"},)"
+                        << R"( {"new_version": 1, "about": "", "symbol_name": "_Z4useri", "patch_file": "q.so"},)"
+                        // A patch of a copy itself is kept apart from the expanded entry of the same version
+                        << R"( {"new_version": 2, "about": "", "symbol_name": "_Z7caller1i", "patch_file": "r.so"}])";
+
+    PatchRegistry registry(meta.string(), closure);
+    auto result = registry.get_patch_directory_since(0);
+    auto all = std::get_if<PatchRange>(&result);
+    ASSERT_NE(all, nullptr);
+    ASSERT_EQ(all->size(), 5u);
+    EXPECT_EQ(all->first[0].symbol_name, "_Z5fixmei");
+    EXPECT_TRUE(all->first[0].expanded_from.empty());
+    for (auto &copy: {all->first[1], all->first[2]}) {
+        EXPECT_EQ(copy.expanded_from, "_Z5fixmei");
+        EXPECT_EQ(copy.new_version, 2);
+        EXPECT_EQ(copy.patch_file, all->first[0].patch_file);
+        EXPECT_EQ(copy.generation, all->first[0].generation);
+    }
+    EXPECT_EQ(all->first[1].symbol_name, "_Z7caller1i");
+    EXPECT_EQ(all->first[2].symbol_name, "_Z7caller2i");
+    EXPECT_EQ(all->first[3].symbol_name, "_Z4useri");
+    EXPECT_EQ(all->first[4].symbol_name, "_Z7caller1i");
+    EXPECT_EQ(all->first[4].patch_file, "r.so");
+    EXPECT_TRUE(all->first[4].expanded_from.empty());
+
+    fs::remove(meta);
+}
+
+FORCE_NO_INLINE int inline_closure_caller(int a) {
+    volatile int result = a;
+    return result * 2;
+}
+
+TEST(RunTimePatchingTests, PatchNowAddsInlinedCopies) {
+    auto closure = std::make_shared<InlineClosure>();
+    closure->copies["_Z5fixmei"] = {"_Z21inline_closure_calleri"};
+    auto meta = fs::temp_directory_path() / "runtime_patching_expand_patch_test.json";
+    // The patch file does not exist, so the copy is found but not patched
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z5fixmei", "patch_file": "none.so"}])";
+
+    auto map = load_patchability_map();
+    ASSERT_TRUE(std::holds_alternative<std::shared_ptr<const PatchabilityMap>>(map));
+    PatchRegistry registry(meta.string(), closure);
+    Patchables patchables;
+    patchables.patchability = std::get<std::shared_ptr<const PatchabilityMap>>(map);
+    patch_now(patchables, registry);
+    EXPECT_TRUE(patchables.empty());
+    ASSERT_EQ(patchables.copies.size(), 1u);
+    EXPECT_EQ(patchables.copies[0].symbol_name, "_Z21inline_closure_calleri");
+    EXPECT_TRUE(patchables.copies[0].expansions.empty());
+    EXPECT_EQ(patchables.copies[0].address, (void *) &inline_closure_caller);
+    EXPECT_EQ(inline_closure_caller(1), 2);
+
+    fs::remove(meta);
+}
+
+/// Contains a copy of fixme in the next test. Patched by tests/test_patch.cpp to return x + 5
+FORCE_NO_INLINE int inline_copy_target(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+TEST(RunTimePatchingTests, PatchNowKeepsTheFixesOfCopiesAndFunctions) {
+    auto closure = std::make_shared<InlineClosure>();
+    closure->copies["_Z5fixmei"] = {"_Z18inline_copy_targeti"};
+    auto dir = fs::temp_directory_path() / "runtime_patching_copy_version_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    // The same replacement in another patch object, which is registered for the function only
+    auto other_patch_file = dir / "other.so";
+    fs::copy_file(TEST_PATCH_FILE, other_patch_file);
+    auto write_registry = [&](const fs::path &meta, const std::vector<std::tuple<string, int, string>> &entries) {
+        std::ofstream o(meta);
+        o << "[";
+        for (size_t i = 0; i < entries.size(); ++i) {
+            o << (i ? ", " : "") << R"({"new_version": )" << std::get<1>(entries[i]) << R"(, "about": "", )"
+              << R"("symbol_name": ")" << std::get<0>(entries[i]) << R"(", "patch_file": ")" << std::get<2>(entries[i])
+              << R"("})";
+        }
+        o << "]";
+    };
+    int (*volatile function)(int) = &inline_copy_target;
+
+    // The function runs version 3 of its own patches. The patch object of the fix of fixme does not carry it.
+    write_registry(dir / "fix.json", {{"_Z5fixmei", 1, TEST_PATCH_FILE}});
+    PatchRegistry fix_registry((dir / "fix.json").string(), closure);
+    Patchables patchables;
+    patchables.emplace_back(Patchable{
+            .address = (void *) &inline_copy_target, .current_version = 3, .symbol_name = "_Z18inline_copy_targeti"});
+    patch_now(patchables, fix_registry);
+    EXPECT_TRUE(patchables.copies.empty());
+    EXPECT_EQ(patchables[0].current_version, 3);
+    EXPECT_TRUE(patchables[0].expansions.empty());
+    EXPECT_EQ(function(1), 2);
+
+    // A patch object that carries both fixes is applied once, and both versions are recorded
+    auto combined = std::vector<std::tuple<string, int, string>>{
+            {"_Z5fixmei", 1, TEST_PATCH_FILE}, {"_Z18inline_copy_targeti", 4, TEST_PATCH_FILE}};
+    write_registry(dir / "combined.json", combined);
+    PatchRegistry combined_registry((dir / "combined.json").string(), closure);
+    patch_now(patchables, combined_registry);
+    EXPECT_TRUE(patchables.copies.empty());
+    EXPECT_EQ(patchables[0].current_version, 4);
+    EXPECT_EQ(patchables[0].expansions, (std::vector<std::pair<string, int>>{{"_Z5fixmei", 1}}));
+    EXPECT_EQ(function(1), 6);
+
+    // A newer patch of the function alone would revert the fix of fixme
+    combined.emplace_back("_Z18inline_copy_targeti", 5, other_patch_file.string());
+    write_registry(dir / "newer.json", combined);
+    PatchRegistry newer_registry((dir / "newer.json").string(), closure);
+    patch_now(patchables, newer_registry);
+    EXPECT_EQ(patchables[0].current_version, 4);
+    EXPECT_EQ(patchables[0].expansions, (std::vector<std::pair<string, int>>{{"_Z5fixmei", 1}}));
+    EXPECT_TRUE(patchables.pending.empty());
+
+    fs::remove_all(dir);
+}
+
+int main(int argc, char **argv) {
+    InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,83 @@
+#include "gtest/gtest.h"
+#include "runtime_patching_lib.h"
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+using ::testing::InitGoogleTest;
+
+/// Replaced by tests/test_patch.cpp in the child process, which returns x + 4
+FORCE_NO_INLINE int process_target(int x) {
+    return x + 1;
+}
+
+/// Answers every byte on `requests` with the result of process_target(1) on `results`
+[[noreturn]] static void serve_process_target(int requests, int results) {
+    char request;
+    while (read(requests, &request, 1) == 1) {
+        int result = process_target(1);
+        if (write(results, &result, sizeof(result)) != sizeof(result)) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+/// Asks the child for process_target(1). Returns -1 if it does not answer within a second.
+static int call_child(int requests, int results) {
+    int result = -1;
+    pollfd answer{results, POLLIN, 0};
+    if (write(requests, "x", 1) != 1 || poll(&answer, 1, 1000) != 1
+        || read(results, &result, sizeof(result)) != sizeof(result)) {
+        return -1;
+    }
+    return result;
+}
+
+TEST(RunTimePatchingTests, PatchProcess) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_process_test.json";
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z14process_targeti", )"
+                        << R"("patch_file": ")" << TEST_PATCH_FILE << R"("}])";
+
+    int requests[2], results[2];
+    ASSERT_EQ(pipe(requests), 0);
+    ASSERT_EQ(pipe(results), 0);
+    auto child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        serve_process_target(requests[0], results[1]);
+    }
+    close(requests[0]);
+    close(results[1]);
+
+    EXPECT_EQ(call_child(requests[1], results[0]), 2);
+    // The child is blocked in read() while being patched, so the injected calls interrupt a system call
+    PatchRegistry registry(meta.string());
+    auto patched = patch_process(child, registry);
+    ASSERT_EQ(patched.index(), 0) << std::get<1>(patched);
+    EXPECT_EQ(std::get<int>(patched), 1);
+    EXPECT_EQ(call_child(requests[1], results[0]), 5);
+
+    // Applied patches are not injected again
+    patched = patch_process(child, registry);
+    ASSERT_EQ(patched.index(), 0) << std::get<1>(patched);
+    EXPECT_EQ(std::get<int>(patched), 0);
+    EXPECT_EQ(call_child(requests[1], results[0]), 5);
+
+    close(requests[1]);
+    close(results[0]);
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    fs::remove(meta);
+}
+
+int main(int argc, char **argv) {
+    InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,355 @@
+#include "gtest/gtest.h"
+#include "runtime_patching_lib.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+using ::testing::InitGoogleTest;
+
+static void write_registry(const fs::path &path, const std::vector<std::pair<string, int>> &entries) {
+    std::ofstream o(path);
+    o << "[";
+    for (size_t i = 0; i < entries.size(); ++i) {
+        o << (i ? "," : "") << R"({"new_version": )" << entries[i].second
+          << R"(, "about": "", "symbol_name": ")" << entries[i].first
+          << R"(", "patch_file": "none.so"})";
+    }
+    o << "]";
+}
+
+TEST(RunTimePatchingTests, RegistryGenerations) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_registry_test.json";
+    write_registry(meta, {{"a", 1}, {"b", 1}});
+
+    PatchRegistry registry(meta.string());
+    auto result = registry.get_patch_directory_since(0);
+    auto all = std::get_if<PatchRange>(&result);
+    ASSERT_NE(all, nullptr);
+    ASSERT_EQ(all->size(), 2u);
+    EXPECT_EQ(all->first[0].generation, 1u);
+    EXPECT_EQ(all->first[1].generation, 2u);
+    EXPECT_EQ(registry.current_generation(), 2u);
+
+    result = registry.get_patch_directory_since(1);
+    auto newer = std::get_if<PatchRange>(&result);
+    ASSERT_NE(newer, nullptr);
+    ASSERT_EQ(newer->size(), 1u);
+    EXPECT_EQ(newer->first->symbol_name, "b");
+
+    result = registry.get_patch_directory_since(registry.current_generation());
+    auto none = std::get_if<PatchRange>(&result);
+    ASSERT_NE(none, nullptr);
+    EXPECT_EQ(none->size(), 0u);
+
+    fs::remove(meta);
+}
+
+TEST(RunTimePatchingTests, RegistryMissingFile) {
+    PatchRegistry registry((fs::temp_directory_path() / "runtime_patching_does_not_exist.json").string());
+    auto result = registry.get_patch_directory_since(0);
+    EXPECT_TRUE(std::holds_alternative<std::string_view>(result));
+}
+
+TEST(RunTimePatchingTests, PatchNowConsumesGeneration) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_consume_test.json";
+    // Versions not bigger than the current one are never applied, so no patch file is required
+    write_registry(meta, {{"a", 1}, {"a", 2}});
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = nullptr, .current_version = 5, .symbol_name = "a"});
+    patch_now(patchables, registry);
+    EXPECT_EQ(patchables.consumed_generation, 2u);
+
+    fs::remove(meta);
+}
+
+/// Replaced by tests/test_patch.cpp, which returns x + 3
+FORCE_NO_INLINE int retry_target(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+TEST(RunTimePatchingTests, PatchNowRetriesPendingPatches) {
+    auto dir = fs::temp_directory_path() / "runtime_patching_retry_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    auto meta = dir / "meta.json";
+    auto patch_file = dir / "retry.so";
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z12retry_targeti", "patch_file": ")"
+                        << patch_file.string() << R"("}])";
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = (void *) &retry_target, .symbol_name = "_Z12retry_targeti"});
+    int (*volatile target)(int) = &retry_target;
+
+    // The patch object has not been deployed yet
+    patch_now(patchables, registry);
+    ASSERT_EQ(patchables.pending.size(), 1u);
+    EXPECT_EQ(target(1), 2);
+    EXPECT_EQ(patchables[0].current_version, 0);
+
+    fs::copy_file(TEST_PATCH_FILE, patch_file);
+    patch_now(patchables, registry);
+    EXPECT_EQ(patchables.pending.size(), 0u);
+    EXPECT_EQ(target(1), 4);
+    EXPECT_EQ(patchables[0].current_version, 1);
+
+    fs::remove_all(dir);
+}
+
+TEST(RunTimePatchingTests, PatchNowMatchesAddedPatchables) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_added_test.json";
+    write_registry(meta, {{"a", 1}, {"b", 1}});
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = nullptr, .current_version = 5, .symbol_name = "a"});
+    patch_now(patchables, registry);
+    EXPECT_TRUE(patchables.pending.empty());
+
+    // The entry for b has been consumed before b was added. none.so does not exist, so it stays pending.
+    patchables.emplace_back(Patchable{.address = (void *) &retry_target, .symbol_name = "b"});
+    patch_now(patchables, registry);
+    ASSERT_EQ(patchables.pending.size(), 1u);
+    EXPECT_EQ(patchables.pending[0].symbol_name, "b");
+
+    fs::remove(meta);
+}
+
+TEST(RunTimePatchingTests, PatchNowDropsPermanentFailures) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_drop_test.json";
+    // The patch object exists, but does not define the symbol
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z13missing_patchi", "patch_file": ")"
+                        << TEST_PATCH_FILE << R"("}])";
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = (void *) &retry_target, .symbol_name = "_Z13missing_patchi"});
+    patch_now(patchables, registry);
+    EXPECT_TRUE(patchables.pending.empty());
+    EXPECT_EQ(patchables[0].current_version, 0);
+
+    fs::remove(meta);
+}
+
+/// Replaced by tests/test_patch.cpp, which returns x + 3 and x + 4
+FORCE_NO_INLINE int worker_target_a(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+FORCE_NO_INLINE int worker_target_b(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+TEST(RunTimePatchingTests, PatchNowPreparesOnWorkers) {
+    auto dir = fs::temp_directory_path() / "runtime_patching_workers_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    // One work item per patch file, so each function gets its own copy of the patch object
+    auto meta = dir / "meta.json";
+    fs::copy_file(TEST_PATCH_FILE, dir / "a.so");
+    fs::copy_file(TEST_PATCH_FILE, dir / "b.so");
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z15worker_target_ai", "patch_file": ")"
+                        << (dir / "a.so").string() << R"("},)"
+                        << R"( {"new_version": 1, "about": "", "symbol_name": "_Z15worker_target_bi", "patch_file": ")"
+                        << (dir / "b.so").string() << R"("}])";
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = (void *) &worker_target_a, .symbol_name = "_Z15worker_target_ai"});
+    patchables.emplace_back(Patchable{.address = (void *) &worker_target_b, .symbol_name = "_Z15worker_target_bi"});
+    patch_now(patchables, registry, 4);
+    EXPECT_EQ(patchables[0].current_version, 1);
+    EXPECT_EQ(patchables[1].current_version, 1);
+    int (*volatile target_a)(int) = &worker_target_a;
+    int (*volatile target_b)(int) = &worker_target_b;
+    EXPECT_EQ(target_a(1), 4);
+    EXPECT_EQ(target_b(1), 5);
+
+    fs::remove_all(dir);
+}
+
+/// Too small for a 64bit jump. Replaced by tests/test_patch.cpp, which returns 2
+FORCE_NO_INLINE int small_target() {
+    return 1;
+}
+
+TEST(RunTimePatchingTests, PatchNowKeepsJumpsWithinTheFunction) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_small_test.json";
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z12small_targetv", "patch_file": ")"
+                        << TEST_PATCH_FILE << R"("}])";
+
+    // The patch object is loaded far away, so that a 64bit jump would be needed
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = (void *) &small_target, .symbol_name = "_Z12small_targetv"});
+    patch_now(patchables, registry);
+    EXPECT_EQ(patchables[0].current_version, 0);
+    int (*volatile target)() = &small_target;
+    EXPECT_EQ(target(), 1);
+
+    fs::remove(meta);
+}
+
+/// Replaced by the patch object of a bundle, tests/test_patch.cpp, which returns x + 3
+FORCE_NO_INLINE int bundle_target(int x) {
+    volatile int result = x;
+    result = result + 1;
+    return result;
+}
+
+TEST(RunTimePatchingTests, RegistryFromBundle) {
+    auto dir = fs::temp_directory_path() / "runtime_patching_bundle_test";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    auto meta = dir / "meta.json";
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_Z13bundle_targeti", )"
+                        << R"("patch_file": "bundle.so"}])";
+    // The registry refers to "bundle.so" relative to the current directory
+    auto old_path = fs::current_path();
+    fs::current_path(dir);
+    fs::copy_file(TEST_PATCH_FILE, "bundle.so");
+
+    auto bundle = dir / "test.bundle";
+    auto written = write_patch_bundle(bundle.string(), meta.string(), {"bundle.so"});
+    ASSERT_TRUE(std::holds_alternative<bool>(written));
+    fs::remove("bundle.so");
+    fs::current_path(old_path);
+
+    string loaded_path;
+    {
+        PatchRegistry registry(bundle.string());
+        Patchables patchables;
+        patchables.emplace_back(Patchable{.address = (void *) &bundle_target, .symbol_name = "_Z13bundle_targeti"});
+        patch_now(patchables, registry);
+        EXPECT_EQ(patchables[0].current_version, 1);
+        int (*volatile target)(int) = &bundle_target;
+        EXPECT_EQ(target(1), 4);
+
+        auto result = registry.get_patch_directory_since(0);
+        auto all = std::get_if<PatchRange>(&result);
+        ASSERT_NE(all, nullptr);
+        ASSERT_EQ(all->size(), 1u);
+        loaded_path = all->first->patch_file;
+        EXPECT_EQ(loaded_path.rfind("/proc/self/fd/", 0), 0u);
+        // The memfd has been closed after loading
+        EXPECT_FALSE(fs::exists(loaded_path));
+    }
+
+    // dlopen identifies loaded libraries by path, so the path must never be reused for another in-memory file
+    PatchRegistry registry(bundle.string());
+    auto result = registry.get_patch_directory_since(0);
+    auto all = std::get_if<PatchRange>(&result);
+    ASSERT_NE(all, nullptr);
+    ASSERT_EQ(all->size(), 1u);
+    EXPECT_NE(all->first->patch_file, loaded_path);
+    std::ifstream materialised(all->first->patch_file, std::ios::binary);
+    char magic[4] = {};
+    materialised.read(magic, sizeof(magic));
+    EXPECT_EQ(string(magic, sizeof(magic)), "\x7f" "ELF");
+
+    fs::remove_all(dir);
+}
+
+TEST(RunTimePatchingTests, RegistryFromDaemon) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_daemon_test.json";
+    auto socket_path = fs::temp_directory_path() / "runtime_patching_daemon_test.sock";
+    write_registry(meta, {{"a", 1}, {"b", 1}});
+
+    std::atomic<bool> stop{false};
+    std::thread daemon([&]() { run_patch_daemon(meta.string(), socket_path.string(), stop); });
+    // The socket is listening shortly after it has been bound
+    for (int i = 0; i < 500 && !fs::exists(socket_path); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (!fs::exists(socket_path)) {
+        stop = true;
+        daemon.join();
+        FAIL() << "The patch daemon did not create its socket";
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    PatchRegistry registry("unix:" + socket_path.string());
+    auto result = registry.get_patch_directory_since(0);
+    auto all = std::get_if<PatchRange>(&result);
+    ASSERT_NE(all, nullptr);
+    ASSERT_EQ(all->size(), 2u);
+    EXPECT_EQ(all->first[1].symbol_name, "b");
+    EXPECT_EQ(all->first[1].patch_file, (fs::current_path() / "none.so").string());
+
+    // A registry change is published to connected clients
+    write_registry(meta, {{"a", 1}, {"b", 1}, {"c", 1}});
+    fs::last_write_time(meta, fs::last_write_time(meta) + std::chrono::seconds(1));
+    size_t new_entries = 0;
+    for (int i = 0; i < 50 && !new_entries; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        result = registry.get_patch_directory_since(2);
+        new_entries = std::get<PatchRange>(result).size();
+    }
+    EXPECT_EQ(new_entries, 1u);
+
+    stop = true;
+    daemon.join();
+
+    // A restarted daemon numbers its entries from 1 again, and the client picks them up after reconnecting
+    write_registry(meta, {{"d", 1}});
+    stop = false;
+    std::thread restarted([&]() { run_patch_daemon(meta.string(), socket_path.string(), stop); });
+    new_entries = 0;
+    for (int i = 0; i < 100 && !new_entries; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (auto range = std::get_if<PatchRange>(&(result = registry.get_patch_directory_since(3)))) {
+            new_entries = range->size();
+        }
+    }
+    ASSERT_EQ(new_entries, 1u);
+    EXPECT_EQ(std::get<PatchRange>(result).first[0].symbol_name, "d");
+
+    stop = true;
+    restarted.join();
+    fs::remove(meta);
+}
+
+TEST(RunTimePatchingTests, RegistryFromStalledDaemon) {
+    auto socket_path = fs::temp_directory_path() / "runtime_patching_stalled_daemon_test.sock";
+    fs::remove(socket_path);
+    sockaddr_un addr{.sun_family = AF_UNIX, .sun_path = {}};
+    socket_path.string().copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(bind(listen_fd, (const sockaddr *) &addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listen_fd, 1), 0);
+
+    // The connection is accepted by the kernel, but no index is ever sent
+    PatchRegistry registry("unix:" + socket_path.string());
+    auto start = std::chrono::steady_clock::now();
+    auto result = registry.get_patch_directory_since(0);
+    EXPECT_EQ(result.index(), 1u);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+
+    // Later calls do not wait at all
+    start = std::chrono::steady_clock::now();
+    result = registry.get_patch_directory_since(0);
+    EXPECT_EQ(std::get<PatchRange>(result).size(), 0u);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+
+    close(listen_fd);
+    fs::remove(socket_path);
+}
+
+int main(int argc, char **argv) {
+    InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
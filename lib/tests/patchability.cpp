@@ -0,0 +1,64 @@
+#include "gtest/gtest.h"
+#include "runtime_patching_lib.h"
+
+#include <cstdlib>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+using ::testing::InitGoogleTest;
+
+FORCE_NO_INLINE int patchability_target(int a, int b) {
+    volatile int sum = 0;
+    for (int i = a; i < b; ++i) {
+        sum = sum + i * a;
+    }
+    return sum;
+}
+
+extern "C" int patchability_alias(int a, int b) noexcept __attribute__((alias("_Z19patchability_targetii")));
+
+TEST(RunTimePatchingTests, PatchabilityMapCachedByBuildId) {
+    auto cache_dir = fs::temp_directory_path() / "runtime_patching_cache_test";
+    fs::remove_all(cache_dir);
+    setenv("XDG_CACHE_HOME", cache_dir.c_str(), 1);
+
+    auto analysed = load_patchability_map();
+    auto map = std::get_if<std::shared_ptr<const PatchabilityMap>>(&analysed);
+    ASSERT_NE(map, nullptr);
+    EXPECT_FALSE((*map)->from_cache);
+    ASSERT_FALSE((*map)->build_id.empty());
+    EXPECT_TRUE(fs::exists(cache_dir / "runtime_patching" / ((*map)->build_id + ".map")));
+
+    auto target = (*map)->find((void *) &patchability_target);
+    ASSERT_NE(target, nullptr);
+    EXPECT_EQ(target->symbol_name, "_Z19patchability_targetii");
+    EXPECT_GE(target->jmp32_overwrite, 5);
+
+    auto cached = load_patchability_map();
+    auto cached_map = std::get_if<std::shared_ptr<const PatchabilityMap>>(&cached);
+    ASSERT_NE(cached_map, nullptr);
+    EXPECT_TRUE((*cached_map)->from_cache);
+    ASSERT_EQ((*cached_map)->functions.size(), (*map)->functions.size());
+    auto cached_target = (*cached_map)->find((void *) &patchability_target);
+    ASSERT_NE(cached_target, nullptr);
+    EXPECT_EQ(cached_target->jmp32_overwrite, target->jmp32_overwrite);
+    EXPECT_EQ(cached_target->jmp64_overwrite, target->jmp64_overwrite);
+
+    // Every name of an address is kept
+    std::set<string> names;
+    for (auto &f: (*cached_map)->functions) {
+        if (f.address == target->address) {
+            names.insert(f.symbol_name);
+            EXPECT_EQ(f.jmp32_overwrite, target->jmp32_overwrite);
+        }
+    }
+    EXPECT_EQ(names, (std::set<string>{"_Z19patchability_targetii", "patchability_alias"}));
+
+    fs::remove_all(cache_dir);
+}
+
+int main(int argc, char **argv) {
+    InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,70 @@
+/// The patched versions of the test functions
+
+/// canary_target in tests/canary.cpp
+int canary_target(int x) {
+    return x + 2;
+}
+
+/// retry_target in tests/patch_registry.cpp
+int retry_target(int x) {
+    return x + 3;
+}
+
+/// VtableTarget::value in tests/vtable_patch.cpp
+struct VtableTarget {
+    virtual ~VtableTarget() = default;
+    virtual int value(int x);
+};
+
+int VtableTarget::value(int x) {
+    return x + 3;
+}
+
+/// process_target in tests/patch_process.cpp
+int process_target(int x) {
+    return x + 4;
+}
+
+/// CanaryConstTarget::value in tests/canary.cpp
+struct CanaryConstTarget {
+    int base;
+    int value(int x) const;
+};
+
+int CanaryConstTarget::value(int x) const {
+    return base + x + 2;
+}
+
+/// small_canary_target in tests/canary.cpp
+int small_canary_target() {
+    return 2;
+}
+
+/// deferred_canary_target in tests/canary.cpp
+int deferred_canary_target(int x) {
+    return x + 2;
+}
+
+/// inline_copy_target in tests/inline_closure.cpp
+int inline_copy_target(int x) {
+    return x + 5;
+}
+
+/// worker_target_a and worker_target_b in tests/patch_registry.cpp
+int worker_target_a(int x) {
+    return x + 3;
+}
+
+int worker_target_b(int x) {
+    return x + 4;
+}
+
+/// small_target in tests/patch_registry.cpp
+int small_target() {
+    return 2;
+}
+
+/// bundle_target in tests/patch_registry.cpp
+int bundle_target(int x) {
+    return x + 3;
+}
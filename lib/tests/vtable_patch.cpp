@@ -1,19 +1,78 @@
 #include "gtest/gtest.h"
 #include "runtime_patching_lib.h"
 
-using ::testing::EmptyTestEventListener;
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
 using ::testing::InitGoogleTest;
-using ::testing::Test;
-using ::testing::TestEventListeners;
-using ::testing::TestInfo;
-using ::testing::TestPartResult;
-using ::testing::UnitTest;
+
+/// Its vtable entry is replaced by tests/test_patch.cpp, which returns x + 3
+struct VtableTarget {
+    virtual ~VtableTarget() = default;
+    virtual int value(int x);
+};
+
+FORCE_NO_INLINE int VtableTarget::value(int x) {
+    return x + 1;
+}
 
 TEST(RunTimePatchingTests, VTablePatch) {
-    EXPECT_TRUE(true);
+    auto meta = fs::temp_directory_path() / "runtime_patching_vtable_test.json";
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_ZN12VtableTarget5valueEi", )"
+                        << R"("patch_file": ")" << TEST_PATCH_FILE << R"("}])";
+
+    VtableTarget object;
+    VtableTarget *volatile target = &object;
+    auto vtable = *(void **) &object;
+    // A pointer to a virtual member function is 1 + the byte offset of its vtable slot (Itanium C++ ABI)
+    int value_index = int(((uintptr_t) cpp_class_member_address(&VtableTarget::value) - 1) / sizeof(void *));
+    ASSERT_EQ(value_index, 2);
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{
+            .address = vtable, .vtable_index = value_index, .symbol_name = "_ZN12VtableTarget5valueEi"});
+    EXPECT_EQ(target->value(1), 2);
+    patch_now(patchables, registry);
+    EXPECT_EQ(patchables[0].current_version, 1);
+    EXPECT_EQ(target->value(1), 4);
+
+    fs::remove(meta);
+}
+
+TEST(RunTimePatchingTests, VTablePatchKeepsWritableVtables) {
+    auto meta = fs::temp_directory_path() / "runtime_patching_writable_vtable_test.json";
+    std::ofstream(meta) << R"([{"new_version": 1, "about": "", "symbol_name": "_ZN12VtableTarget5valueEi", )"
+                        << R"("patch_file": ")" << TEST_PATCH_FILE << R"("}])";
+
+    // A copy of the vtable in writable memory, like in binaries without RELRO: The offset to top, the type info,
+    // both destructors and value
+    VtableTarget object;
+    VtableTarget *volatile target = &object;
+    auto page = (void **) mmap(nullptr, getpagesize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(page, MAP_FAILED);
+    memcpy(page, *(void ***) &object - 2, 5 * sizeof(void *));
+    auto vtable = page + 2;
+    *(void ***) &object = vtable;
+
+    PatchRegistry registry(meta.string());
+    Patchables patchables;
+    patchables.emplace_back(Patchable{.address = vtable, .vtable_index = 2, .symbol_name = "_ZN12VtableTarget5valueEi"});
+    patch_now(patchables, registry);
+    EXPECT_EQ(patchables[0].current_version, 1);
+    EXPECT_EQ(target->value(1), 4);
+    // Still writable
+    page[getpagesize() / sizeof(void *) - 1] = nullptr;
+
+    fs::remove(meta);
 }
 
 int main(int argc, char **argv) {
     InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}
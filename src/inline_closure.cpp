@@ -0,0 +1,49 @@
+//! Build time analysis of the functions that contain inlined copies or clones of other functions.
+//!
+//! Usage: inline_closure <closure_file> <ipa_clones_dump_or_directory...>
+//! The dump files are written by GCC for each translation unit, if compiled with -fdump-ipa-clones.
+//! Directories are searched recursively for files ending with "ipa-clones", as GCC versions name them differently.
+//! The closure file maps each function to all functions that have to be patched along with it. Pass it to the
+//! ::PatchRegistry, so that a patch for a function is also applied to those.
+
+#include <filesystem>
+#include <iostream>
+
+#include "runtime_patching_lib.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <closure_file> <ipa_clones_dump_or_directory...>\n";
+        return 1;
+    }
+
+    std::vector<string> dump_files;
+    for (int i = 2; i < argc; ++i) {
+        if (!std::filesystem::is_directory(argv[i])) {
+            dump_files.emplace_back(argv[i]);
+            continue;
+        }
+        for (auto &entry: std::filesystem::recursive_directory_iterator(argv[i])) {
+            auto name = entry.path().filename().string();
+            if (entry.is_regular_file() && name.size() > 10 && name.compare(name.size() - 10, 10, "ipa-clones") == 0) {
+                dump_files.push_back(entry.path().string());
+            }
+        }
+    }
+    auto result = read_ipa_clones(dump_files);
+    if (auto error = std::get_if<std::string_view>(&result)) {
+        std::cerr << "Failed to read the ipa clones dumps: " << *error << "\n";
+        return 1;
+    }
+    auto &closure = std::get<InlineClosure>(result);
+    for (auto &entry: closure.copies) {
+        std::cout << entry.first << ": " << entry.second.size() << " copies\n";
+    }
+
+    auto written = write_inline_closure(argv[1], closure);
+    if (auto error = std::get_if<std::string_view>(&written)) {
+        std::cerr << "Failed to write " << argv[1] << ": " << *error << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -10,7 +10,7 @@
 
 using namespace std;
 
-int main() {
+int main(int argc, char **argv) {
     init_term();
 
     DemoClass demo;
@@ -18,8 +18,24 @@ int main() {
     auto say_hello = bind(&DemoClass::say_hello, &demo, 42, "from C++ member function");
     auto say_hello_fun_bind = bind(&say_hello_fun, 42, "from C function");
 
-    PatchRegistry registry("registry/meta.json");
+    // Patches are also applied to the functions that contain inlined copies of the patched ones, if given
+    std::shared_ptr<const InlineClosure> inline_closure;
+    if (argc > 2) {
+        auto closure = load_inline_closure(argv[2]);
+        if (auto error = std::get_if<std::string_view>(&closure)) {
+            std::cerr << "Failed to load " << argv[2] << ": " << *error << "\n";
+        } else {
+            inline_closure = std::get<std::shared_ptr<const InlineClosure>>(closure);
+        }
+    }
+    // A json registry file or a patch bundle
+    PatchRegistry registry(argc > 1 ? argv[1] : "registry/meta.json", inline_closure);
     Patchables patchables;
+    // Analysed once per build, loaded from the cache afterwards
+    auto patchability = load_patchability_map();
+    if (auto map = std::get_if<std::shared_ptr<const PatchabilityMap>>(&patchability)) {
+        patchables.patchability = *map;
+    }
     auto v = cpp_class_member_address(&DemoClass::say_hello);
     std::clog << v << "\n" << &demo << "\n" << typeid(&DemoClass::say_hello).name() << "\n";
 
@@ -39,11 +55,13 @@ int main() {
     });
 
     std::cout << "Press u for updating the registry. Press p for patching. Press c for canceling.\n";
+    std::cout << "Press k to start a canary of say_hello_fun, r for its report, o to promote and x to abort it.\n";
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) != nullptr) {
         std::cout << "Current working dir: " << cwd << "\n";
     }
     std::cout.flush();    // ensure output is written
+    Canary *canary = nullptr;
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wmissing-noreturn"
@@ -78,6 +96,40 @@ int main() {
                 patch_now(patchables, registry);
                 break;
             }
+            case 'k': {
+                auto started = start_canary<&say_hello_fun>(patchables[1], registry, 0.5);
+                if (auto error = std::get_if<std::string_view>(&started)) {
+                    std::cerr << "Failed to start canary: " << *error << "\n";
+                    continue;
+                }
+                canary = std::get<Canary *>(started);
+                break;
+            }
+            case 'r': {
+                if (!canary) {
+                    continue;
+                }
+                auto report = canary->report();
+                std::cout << "Original: " << report.original.count() << " calls, median < "
+                          << report.original.quantile_ns(0.5) << " ns, p99 < " << report.original.quantile_ns(0.99)
+                          << " ns\n";
+                std::cout << "Patched: " << report.patched.count() << " calls, median < "
+                          << report.patched.quantile_ns(0.5) << " ns, p99 < " << report.patched.quantile_ns(0.99)
+                          << " ns\n";
+                break;
+            }
+            case 'o':
+            case 'x': {
+                if (!canary) {
+                    continue;
+                }
+                auto result = c == 'o' ? canary->promote() : canary->abort();
+                if (auto error = std::get_if<std::string_view>(&result)) {
+                    std::cerr << *error << "\n";
+                }
+                canary = nullptr;
+                break;
+            }
             case 'c': {
                 return 0;
             }
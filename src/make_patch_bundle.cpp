@@ -0,0 +1,23 @@
+//! Packs the registry meta data and patch objects into a single patch bundle file.
+//!
+//! Usage: make_patch_bundle <bundle_file> <registry_file> [patch_file...]
+//! Patch files are stored under the path given on the command line. Those must match the registry "patch_file" entries.
+
+#include <iostream>
+
+#include "runtime_patching_lib.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <bundle_file> <registry_file> [patch_file...]\n";
+        return 1;
+    }
+
+    std::vector<string> patch_files(argv + 3, argv + argc);
+    auto result = write_patch_bundle(argv[1], argv[2], patch_files);
+    if (auto error = std::get_if<std::string_view>(&result)) {
+        std::cerr << "Failed to write " << argv[1] << ": " << *error << "\n";
+        return 1;
+    }
+    return 0;
+}
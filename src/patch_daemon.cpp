@@ -0,0 +1,29 @@
+//! The host wide patch daemon. Processes connect with a "unix:<socket_path>" registry URI.
+//!
+//! Usage: patch_daemon <registry_uri> <socket_path>
+
+#include <csignal>
+#include <iostream>
+
+#include "runtime_patching_lib.h"
+
+static std::atomic<bool> stop{false};
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <registry_uri> <socket_path>\n";
+        return 1;
+    }
+
+    struct sigaction action{};
+    action.sa_handler = [](int) { stop = true; };
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    auto result = run_patch_daemon(argv[1], argv[2], stop);
+    if (auto error = std::get_if<std::string_view>(&result)) {
+        std::cerr << "Patch daemon failed: " << *error << "\n";
+        return 1;
+    }
+    return 0;
+}
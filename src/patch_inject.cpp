@@ -0,0 +1,23 @@
+//! Patches a running process from the outside via ptrace.
+//!
+//! Usage: patch_inject <pid> <registry_uri>
+
+#include <iostream>
+
+#include "runtime_patching_lib.h"
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <pid> <registry_uri>\n";
+        return 1;
+    }
+
+    PatchRegistry registry(argv[2]);
+    auto result = patch_process(std::stoi(argv[1]), registry);
+    if (auto error = std::get_if<std::string_view>(&result)) {
+        std::cerr << "Patching process " << argv[1] << " failed: " << *error << "\n";
+        return 1;
+    }
+    std::cout << "Applied " << std::get<int>(result) << " patches\n";
+    return 0;
+}
@@ -0,0 +1,53 @@
+//! Pre-deploy report of functions that cannot be live patched.
+//!
+//! Usage: patchability_report <elf_file> [symbol...]
+//! Without symbols, all unpatchable functions are listed. With symbols (for example the hot functions of a service),
+//! only those are checked. Exits with 1 if any checked function cannot be patched with a 64bit jump.
+
+#include <iostream>
+#include <set>
+
+#include "runtime_patching_lib.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <elf_file> [symbol...]\n";
+        return 1;
+    }
+
+    auto result = load_patchability_map(argv[1]);
+    if (auto error = std::get_if<std::string_view>(&result)) {
+        std::cerr << "Failed to analyse " << argv[1] << ": " << *error << "\n";
+        return 1;
+    }
+    auto &map = *std::get<std::shared_ptr<const PatchabilityMap>>(result);
+    std::set<string> symbols(argv + 2, argv + argc);
+    bool all = symbols.empty();
+
+    size_t checked = 0, unpatchable = 0;
+    for (auto &f: map.functions) {
+        if (!all && !symbols.erase(f.symbol_name)) {
+            continue;
+        }
+        ++checked;
+        if (f.jmp64_overwrite) {
+            continue;
+        }
+        ++unpatchable;
+        std::cout << f.symbol_name << ": ";
+        if (f.decoded < JMP64_SIZE) {
+            std::cout << "unknown prologue instruction at +" << int(f.decoded);
+        } else {
+            std::cout << "function too small (" << f.size << " bytes)";
+        }
+        std::cout << (f.jmp32_overwrite ? ", only patchable with a near jump" : "") << "\n";
+    }
+    for (auto &missing: symbols) {
+        ++unpatchable;
+        std::cout << missing << ": not found\n";
+    }
+
+    std::cout << unpatchable << " of " << checked + symbols.size() << " functions cannot be patched"
+              << (map.from_cache ? " (cached)" : "") << "\n";
+    return unpatchable ? 1 : 0;
+}